@@ -8,14 +8,11 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <string.h>
-
-/* We can build a tree of who was infected by who; but we don't yet
-   have any way of reading this data out, so I've turned it off for
-   now.  In the real world, someone might be infected by more than one
-   person, of course, so this may not be that useful. */
-// #define TRACING 1
+#include <sys/mman.h>
+#include <stdatomic.h>
 
 /* Output PNG files to show the spread */
 // #define PRODUCE_IMAGES 1
@@ -28,17 +25,14 @@
    based on them, so they can be changed easily and be tracked by
    their dependents: */
 #define SPREADER_GRADE_BITS 2
+#define AGE_BITS 7
 
 /* A very compact representation of a person, so we can do millions of
    them on a fairly ordinary machine. */
 typedef struct person_t {
-  unsigned int days_in_state  : 10;
   unsigned int state          : 4;
   unsigned int spreader_grade : SPREADER_GRADE_BITS;
-  unsigned int age            : 7;
-#ifdef TRACING
-  unsigned int infected_by;
-#endif
+  unsigned int age            : AGE_BITS;
 } person_t;
 
 /* Some counts that we will maintain as people move between states */
@@ -73,9 +67,14 @@ typedef enum state {
     DIED
 } state_t;
 
+#define N_STATES (DIED + 1)
+
 /* Treating the population array as a two-dimensional grid, for
-   purposes of who is near who (and so who can be infected by who): */
-#define Neighbour(_pop_, _base_, _dx_, _dy_) (((_base_) + (_dx_) + ((_dy_) * (_pop_).grid_width)) % (_pop_).population_size)
+   purposes of who is near who (and so who can be infected by who).
+   An offset combines the x and y displacements into one step along
+   the array: */
+#define Grid_Offset(_pop_, _dx_, _dy_) ((_dx_) + ((_dy_) * (int)(_pop_).grid_width))
+#define Neighbour(_pop_, _base_, _offset_) (((_base_) + (_offset_)) % (_pop_).population_size)
 
 #define Beyond(_bits_) (1 << _bits_)
 
@@ -194,20 +193,31 @@ static double default_spreader_data[] = {
 #define Spreader_R(_i_)          (spreader_data[(_i_)*4 + 2])
 #define Spreader_Radius(_i_)     (spreader_data[(_i_)*4 + 3])
 
-static const char *short_options = "a:c:g:hi:I:o:p:P:R:s:v";
+static const char *short_options = "a:c:d:f:F:g:hi:I:k:l:L:n:o:O:p:P:r:R:s:t:T:v";
 
 struct option long_options_data[] = {
   {"age", required_argument, 0, 'a'},
   {"cycles", required_argument, 0, 'c'},
+  {"durations", required_argument, 0, 'd'},
   {"grades", required_argument, 0, 'g'},
   {"help", no_argument, 0, 'h'},
   {"population", required_argument, 0, 'p'},
+  {"population-file", required_argument, 0, 'f'},
+  {"network", required_argument, 0, 'n'},
+  {"layer-weights", required_argument, 0, 'L'},
   {"pictures", required_argument, 0, 'P'},
+  {"frames", required_argument, 0, 'F'},
+  {"keyframe-interval", required_argument, 0, 'k'},
   {"reproduction", required_argument, 0, 'R'},
+  {"replicates", required_argument, 0, 'r'},
   {"starting", required_argument, 0, 's'},
   {"infectious", required_argument, 0, 'i'},
   {"interventions", required_argument, 0, 'I'},
+  {"infection-log", required_argument, 0, 'l'},
   {"output", required_argument, 0, 'o'},
+  {"telemetry", required_argument, 0, 'T'},
+  {"tile-stats", required_argument, 0, 't'},
+  {"tile-output", required_argument, 0, 'O'},
   {"verbose", no_argument, 0, 'v'},
   {0, 0, 0, 0}
 };
@@ -334,6 +344,472 @@ static unsigned int read_table(char *filename, double **data, unsigned int *rows
     return filesize;
 }
 
+/* A binary population file, as made by popconvert, holds the age and
+   spreader grade of each person in a real (or synthetic) population,
+   so we don't have to make them up from the distributions.  It starts
+   with a population_file_header_t, followed by a population_record_t
+   for each person.  If the POPULATION_POSITIONED flag is set, that is
+   followed (at the next multiple of four bytes) by a uint32_t for each
+   person, giving the grid cell they live in, as y * grid_width + x;
+   otherwise, people are laid out across the grid in file order, and
+   the grid dimensions in the header are ignored.
+
+   The file is mapped straight into memory, rather than read and
+   parsed, so that loading a huge population is limited by how fast
+   the disk can deliver it. */
+#define POPULATION_FILE_MAGIC "EPIPOP1"
+#define POPULATION_POSITIONED 1
+
+typedef struct population_file_header_t {
+    char magic[8];
+    uint32_t people;
+    uint32_t grid_width;
+    uint32_t grid_height;
+    uint32_t flags;
+} population_file_header_t;
+
+typedef struct population_record_t {
+    uint8_t age;
+    uint8_t spreader_grade;
+} population_record_t;
+
+#define Population_Cells_Offset(_people_) ((sizeof(population_file_header_t) + (_people_) * sizeof(population_record_t) + 3) & ~(size_t)3)
+
+/* Fill in the population grid from a binary population file.  Grid
+   cells that nobody lives in are left as NOBODY.  If use_positions is
+   zero, any positions in the file are ignored.  Returns the number of
+   people, or zero if the file could not be used. */
+static unsigned int load_population(char *filename, population_grid_t *population, int use_positions) {
+    int filedesc = open(filename, O_RDONLY);
+    if (filedesc == -1) {
+        fprintf(stderr, "Could not open population file \"%s\"\n", filename);
+        return 0;
+    }
+    struct stat filestats;
+    if (fstat(filedesc, &filestats) != 0
+        || filestats.st_size < sizeof(population_file_header_t)) {
+        fprintf(stderr, "Population file \"%s\" is too short\n", filename);
+        close(filedesc);
+        return 0;
+    }
+    size_t filesize = filestats.st_size;
+    void *mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, filedesc, 0);
+    close(filedesc);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Could not map population file \"%s\"\n", filename);
+        return 0;
+    }
+    madvise(mapped, filesize, MADV_SEQUENTIAL);
+
+    const population_file_header_t *header = (const population_file_header_t*)mapped;
+    size_t people = header->people;
+    int positioned = (header->flags & POPULATION_POSITIONED) != 0;
+    size_t expected_size = positioned
+        ? Population_Cells_Offset(people) + people * sizeof(uint32_t)
+        : sizeof(population_file_header_t) + people * sizeof(population_record_t);
+    if (memcmp(header->magic, POPULATION_FILE_MAGIC, sizeof(POPULATION_FILE_MAGIC)) != 0
+        || people == 0
+        || filesize < expected_size) {
+        fprintf(stderr, "\"%s\" is not a usable population file\n", filename);
+        munmap(mapped, filesize);
+        return 0;
+    }
+    const population_record_t *records = (const population_record_t*)(header + 1);
+    const uint32_t *cells = (const uint32_t*)((const char*)mapped + Population_Cells_Offset(people));
+    if (!use_positions) {
+        positioned = 0;
+    }
+
+    if (positioned) {
+        /* the grid size comes straight from the file, so make sure it
+           can be indexed before we trust it: */
+        if (header->grid_width == 0 || header->grid_height == 0
+            || (uint64_t)header->grid_width * header->grid_height > UINT32_MAX) {
+            fprintf(stderr, "Population file \"%s\" has an unusable grid of %u by %u\n",
+                    filename, header->grid_width, header->grid_height);
+            munmap(mapped, filesize);
+            return 0;
+        }
+        population->grid_width = header->grid_width;
+        population->grid_height = header->grid_height;
+    } else {
+        population->grid_width = (unsigned int)floor(sqrt((double)people));
+        population->grid_height = (people + population->grid_width - 1) / population->grid_width;
+    }
+    population->population_size = population->grid_width * population->grid_height;
+    population->population = (person_t*)malloc(population->population_size*sizeof(person_t));
+
+    /* Each thread first touches the part of the grid it will fill in,
+       so the pages end up near the threads that use them. */
+#pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < population->population_size; i++) {
+        person_t nobody = {NOBODY, 0, 0};
+        population->population[i] = nobody;
+    }
+
+    /* Each cell is claimed in this bitmap by whoever is put in it, so
+       that two people given the same position are noticed instead of
+       one of them quietly overwriting the other. */
+    uint32_t *claimed = (uint32_t*)calloc((population->population_size + 31) / 32, sizeof(uint32_t));
+    unsigned int misplaced = 0;
+    unsigned int collisions = 0;
+    unsigned int unrepresentable = 0;
+#pragma omp parallel for schedule(static) reduction(+:misplaced,collisions,unrepresentable)
+    for (size_t i = 0; i < people; i++) {
+        size_t cell = positioned ? cells[i] : i;
+        if (records[i].age >= Beyond(AGE_BITS)
+            || records[i].spreader_grade >= N_SPREADER_GRADES) {
+            unrepresentable++;
+        } else if (cell >= population->population_size) {
+            misplaced++;
+        } else if (__atomic_fetch_or(&claimed[cell / 32], (uint32_t)1 << (cell % 32), __ATOMIC_RELAXED)
+                   & ((uint32_t)1 << (cell % 32))) {
+            collisions++;
+        } else {
+            person_t person = {SUSCEPTIBLE, records[i].spreader_grade, records[i].age};
+            population->population[cell] = person;
+        }
+    }
+    free(claimed);
+
+    munmap(mapped, filesize);
+    if (unrepresentable != 0 || collisions != 0) {
+        if (unrepresentable != 0) {
+            fprintf(stderr, "%u people in population file \"%s\" have an age or spreader grade out of range\n",
+                    unrepresentable, filename);
+        }
+        if (collisions != 0) {
+            fprintf(stderr, "%u people in population file \"%s\" are in the same place as someone else\n",
+                    collisions, filename);
+        }
+        free(population->population);
+        population->population = NULL;
+        return 0;
+    }
+    if (misplaced != 0) {
+        fprintf(stderr, "%u people in population file \"%s\" are outside the grid\n", misplaced, filename);
+    }
+    return (unsigned int)(people - misplaced);
+}
+
+/* Instead of the grid, people can meet each other through a network of
+   contacts, such as households, schools and workplaces, each of which
+   is a "layer" of the network.  The network comes from a binary file,
+   as made by netconvert, which starts with a network_file_header_t,
+   followed by a pair of uint32_t vertex numbers (from, to) for each
+   contact, and then a uint8_t layer number for each contact.  Each
+   person in the population is a vertex in the network.
+
+   We hold the network in compressed sparse row form, with the
+   contacts of each person in each layer together, so we can pick a
+   layer by its weight and then pick a contact within it.  The people
+   are renumbered in reverse Cuthill-McKee order as the network is
+   loaded, so that people who are in contact are mostly near each
+   other in memory. */
+#define NETWORK_FILE_MAGIC "EPINET1"
+#define MAX_CONTACT_LAYERS 8
+
+typedef struct network_file_header_t {
+    char magic[8];
+    uint32_t vertices;
+    uint32_t layers;
+    uint64_t edges;
+} network_file_header_t;
+
+typedef struct contact_network_t {
+    unsigned int vertices;
+    unsigned int layers;
+    uint64_t *row_offsets;      /* where each person's contacts in each layer start, vertices * layers + 1 of them */
+    uint32_t *contacts;
+    uint32_t *renumbering;      /* the new number of each vertex in the file */
+    uint32_t *original_numbers; /* the number in the file of each renumbered vertex */
+    /* the weight of each layer, as a share of RANDOM_RANGE: */
+    uint32_t layer_weights[MAX_CONTACT_LAYERS];
+} contact_network_t;
+
+static contact_network_t *contact_network = NULL;
+
+/* Fill in the rows of the network from the edges in the file, with
+   the vertices renumbered if renumbering is not NULL. */
+static void build_contact_rows(contact_network_t *network,
+                               const uint32_t *edges, const uint8_t *layers, uint64_t edge_count,
+                               const uint32_t *renumbering) {
+    size_t rows = (size_t)network->vertices * network->layers;
+    network->row_offsets = (uint64_t*)calloc(rows + 1, sizeof(uint64_t));
+    network->contacts = (uint32_t*)malloc(edge_count * sizeof(uint32_t));
+    for (uint64_t e = 0; e < edge_count; e++) {
+        uint32_t from = renumbering ? renumbering[edges[2*e]] : edges[2*e];
+        network->row_offsets[(size_t)from * network->layers + layers[e] + 1]++;
+    }
+    for (size_t row = 0; row < rows; row++) {
+        network->row_offsets[row + 1] += network->row_offsets[row];
+    }
+    /* use the starts of the following rows as fill pointers, then
+       shift them back down into place: */
+    for (uint64_t e = 0; e < edge_count; e++) {
+        uint32_t from = renumbering ? renumbering[edges[2*e]] : edges[2*e];
+        uint32_t to = renumbering ? renumbering[edges[2*e + 1]] : edges[2*e + 1];
+        network->contacts[network->row_offsets[(size_t)from * network->layers + layers[e]]++] = to;
+    }
+    memmove(&network->row_offsets[1], &network->row_offsets[0], rows * sizeof(uint64_t));
+    network->row_offsets[0] = 0;
+}
+
+#define Network_Degree(_network_, _v_) ((_network_)->row_offsets[((size_t)(_v_) + 1) * (_network_)->layers] \
+                                        - (_network_)->row_offsets[(size_t)(_v_) * (_network_)->layers])
+
+static contact_network_t *rcm_network;
+
+static int compare_degrees(const void *a, const void *b) {
+    uint64_t degree_a = Network_Degree(rcm_network, *(const uint32_t*)a);
+    uint64_t degree_b = Network_Degree(rcm_network, *(const uint32_t*)b);
+    return (degree_a > degree_b) - (degree_a < degree_b);
+}
+
+/* Work out the reverse Cuthill-McKee numbering: go breadth-first
+   through each connected part of the network, starting from its
+   least-connected person, and taking each person's contacts in order
+   of how connected they are; then number everyone in the reverse of
+   that order. */
+static uint32_t *reverse_cuthill_mckee(contact_network_t *network) {
+    unsigned int vertices = network->vertices;
+    uint32_t *by_degree = (uint32_t*)malloc(vertices * sizeof(uint32_t));
+    uint32_t *order = (uint32_t*)malloc(vertices * sizeof(uint32_t));
+    uint8_t *visited = (uint8_t*)calloc(vertices, 1);
+    rcm_network = network;
+    for (unsigned int v = 0; v < vertices; v++) {
+        by_degree[v] = v;
+    }
+    qsort(by_degree, vertices, sizeof(uint32_t), compare_degrees);
+
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    for (unsigned int k = 0; k < vertices; k++) {
+        if (visited[by_degree[k]]) {
+            continue;
+        }
+        visited[by_degree[k]] = 1;
+        order[tail++] = by_degree[k];
+        while (head < tail) {
+            unsigned int v = order[head++];
+            unsigned int first_new = tail;
+            for (uint64_t c = network->row_offsets[(size_t)v * network->layers];
+                 c < network->row_offsets[((size_t)v + 1) * network->layers];
+                 c++) {
+                uint32_t contact = network->contacts[c];
+                if (!visited[contact]) {
+                    visited[contact] = 1;
+                    order[tail++] = contact;
+                }
+            }
+            qsort(&order[first_new], tail - first_new, sizeof(uint32_t), compare_degrees);
+        }
+    }
+
+    uint32_t *renumbering = by_degree;
+    for (unsigned int k = 0; k < vertices; k++) {
+        renumbering[order[k]] = vertices - 1 - k;
+    }
+    free(visited);
+    free(order);
+    return renumbering;
+}
+
+static contact_network_t *load_contact_network(char *filename, double *layer_weights, unsigned int layer_weights_given) {
+    int filedesc = open(filename, O_RDONLY);
+    if (filedesc == -1) {
+        fprintf(stderr, "Could not open network file \"%s\"\n", filename);
+        return NULL;
+    }
+    struct stat filestats;
+    if (fstat(filedesc, &filestats) != 0
+        || filestats.st_size < sizeof(network_file_header_t)) {
+        fprintf(stderr, "Network file \"%s\" is too short\n", filename);
+        close(filedesc);
+        return NULL;
+    }
+    size_t filesize = filestats.st_size;
+    void *mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, filedesc, 0);
+    close(filedesc);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Could not map network file \"%s\"\n", filename);
+        return NULL;
+    }
+    madvise(mapped, filesize, MADV_SEQUENTIAL);
+
+    const network_file_header_t *header = (const network_file_header_t*)mapped;
+    uint64_t edge_count = header->edges;
+    if (memcmp(header->magic, NETWORK_FILE_MAGIC, sizeof(NETWORK_FILE_MAGIC)) != 0
+        || header->vertices == 0
+        || header->layers == 0 || header->layers > MAX_CONTACT_LAYERS
+        || filesize < sizeof(network_file_header_t) + edge_count * (2 * sizeof(uint32_t) + sizeof(uint8_t))) {
+        fprintf(stderr, "\"%s\" is not a usable network file\n", filename);
+        munmap(mapped, filesize);
+        return NULL;
+    }
+    double total_weight = 0;
+    for (unsigned int layer = 0; layer < header->layers; layer++) {
+        total_weight += (layer < layer_weights_given) ? layer_weights[layer] : 1.0;
+    }
+    if (!(total_weight > 0.0)) {
+        fprintf(stderr, "The layer weights for network file \"%s\" add up to nothing\n", filename);
+        munmap(mapped, filesize);
+        return NULL;
+    }
+    const uint32_t *edges = (const uint32_t*)(header + 1);
+    const uint8_t *layers = (const uint8_t*)(edges + 2 * edge_count);
+    for (uint64_t e = 0; e < edge_count; e++) {
+        if (edges[2*e] >= header->vertices || edges[2*e + 1] >= header->vertices || layers[e] >= header->layers) {
+            fprintf(stderr, "Bad contact %lu in network file \"%s\"\n", (unsigned long)e, filename);
+            munmap(mapped, filesize);
+            return NULL;
+        }
+    }
+
+    contact_network_t *network = (contact_network_t*)malloc(sizeof(contact_network_t));
+    network->vertices = header->vertices;
+    network->layers = header->layers;
+
+    build_contact_rows(network, edges, layers, edge_count, NULL);
+    network->renumbering = reverse_cuthill_mckee(network);
+    free(network->row_offsets);
+    free(network->contacts);
+    build_contact_rows(network, edges, layers, edge_count, network->renumbering);
+    munmap(mapped, filesize);
+    network->original_numbers = (uint32_t*)malloc(network->vertices * sizeof(uint32_t));
+    for (unsigned int v = 0; v < network->vertices; v++) {
+        network->original_numbers[network->renumbering[v]] = v;
+    }
+
+    for (unsigned int layer = 0; layer < network->layers; layer++) {
+        double weight = (layer < layer_weights_given) ? layer_weights[layer] : 1.0;
+        network->layer_weights[layer] = (uint32_t)(weight / total_weight * (double)(1U << 31));
+    }
+    return network;
+}
+
+static void free_contact_network(contact_network_t *network) {
+    free(network->renumbering);
+    free(network->original_numbers);
+    free(network->row_offsets);
+    free(network->contacts);
+    free(network);
+}
+
+/* For long runs, we can publish how we're getting on in a block of
+   POSIX shared memory, which epidemic_top can watch without slowing
+   us down.  It is updated once a day, as a seqlock: the sequence
+   number is odd while an update is in progress, so a reader copies
+   the block, and tries again if the sequence number was odd or changed
+   while it was copying. */
+#define TELEMETRY_MAGIC 0x45504954
+
+typedef struct telemetry_t {
+    uint32_t magic;
+    _Atomic uint32_t sequence;
+    int32_t pid;
+    uint32_t finished;
+    uint32_t population_size;
+    uint32_t cycles;
+    uint32_t day;
+    counts_t counts;
+    /* the time taken by each phase of the most recent day; the
+       transitions are the people moved on by the timer wheel: */
+    double intervention_seconds;
+    double transition_seconds;
+    double sweep_seconds;
+    double output_seconds;
+    double days_per_second;
+    uint64_t resident_bytes;
+} telemetry_t;
+
+static telemetry_t *open_telemetry(char *name, unsigned int population_size, unsigned int cycles) {
+    char *shm_name = (char*)malloc(strlen(name) + 2);
+    sprintf(shm_name, "/%s", name);
+    /* Don't take over a block that someone else may be publishing to,
+       or watching: */
+    int filedesc = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (filedesc == -1 && errno == EEXIST) {
+        fprintf(stderr, "There is already a telemetry block called \"%s\"; if it is left over from a run that crashed, remove /dev/shm/%s\n", name, name);
+        free(shm_name);
+        return NULL;
+    }
+    if (filedesc == -1 || ftruncate(filedesc, sizeof(telemetry_t)) != 0) {
+        fprintf(stderr, "Could not create telemetry block \"%s\"\n", name);
+        if (filedesc != -1) {
+            close(filedesc);
+            shm_unlink(shm_name);
+        }
+        free(shm_name);
+        return NULL;
+    }
+    free(shm_name);
+    telemetry_t *telemetry = (telemetry_t*)mmap(NULL, sizeof(telemetry_t), PROT_READ | PROT_WRITE, MAP_SHARED, filedesc, 0);
+    close(filedesc);
+    if (telemetry == MAP_FAILED) {
+        fprintf(stderr, "Could not map telemetry block \"%s\"\n", name);
+        return NULL;
+    }
+    memset(telemetry, 0, sizeof(telemetry_t));
+    telemetry->pid = getpid();
+    telemetry->population_size = population_size;
+    telemetry->cycles = cycles;
+    telemetry->magic = TELEMETRY_MAGIC;
+    return telemetry;
+}
+
+static uint64_t resident_bytes() {
+    unsigned long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %lu", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return (uint64_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+static void publish_telemetry(telemetry_t *telemetry, unsigned int day, counts_t *counts,
+                              double intervention_seconds, double transition_seconds,
+                              double sweep_seconds, double output_seconds,
+                              double days_per_second) {
+    uint64_t resident = resident_bytes();
+    uint32_t sequence = atomic_load_explicit(&telemetry->sequence, memory_order_relaxed);
+    atomic_store_explicit(&telemetry->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    telemetry->day = day;
+    telemetry->counts = *counts;
+    telemetry->intervention_seconds = intervention_seconds;
+    telemetry->transition_seconds = transition_seconds;
+    telemetry->sweep_seconds = sweep_seconds;
+    telemetry->output_seconds = output_seconds;
+    telemetry->days_per_second = days_per_second;
+    telemetry->resident_bytes = resident;
+    atomic_store_explicit(&telemetry->sequence, sequence + 2, memory_order_release);
+}
+
+static void close_telemetry(telemetry_t *telemetry, char *name) {
+    uint32_t sequence = atomic_load_explicit(&telemetry->sequence, memory_order_relaxed);
+    atomic_store_explicit(&telemetry->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    telemetry->finished = 1;
+    atomic_store_explicit(&telemetry->sequence, sequence + 2, memory_order_release);
+    munmap(telemetry, sizeof(telemetry_t));
+    /* Anyone watching keeps their mapping, so they still see that
+       we've finished. */
+    char *shm_name = (char*)malloc(strlen(name) + 2);
+    sprintf(shm_name, "/%s", name);
+    shm_unlink(shm_name);
+    free(shm_name);
+}
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
 static void
 print_usage() {
   printf("Usage:\n  growth\n");
@@ -342,28 +818,570 @@ print_usage() {
 static double *spreader_data = NULL;
 static unsigned int infectious_days = 10;
 
-static void infect(unsigned int who, population_grid_t *population, counts_t *counts) {
-    double personal_r = Spreader_R(population->population[who].spreader_grade);
-    while (personal_r / infectious_days >= 0.0) {
-        if (drand48() < personal_r / infectious_days) {
-            /* we're going to infect someone, pick someone in our travel range */
-            unsigned int personal_travel_limit = (unsigned int)Spreader_Radius(population->population[who].spreader_grade);
-            int delta_x = (int)((drand48() * 2.0 - 1.0) * personal_travel_limit);
-            int delta_y = (int)((drand48() * 2.0 - 1.0) * personal_travel_limit);
-            if (delta_x != 0 || delta_y != 0) {
-                person_t *neighbour = &(population->population)[Neighbour(*population, who, delta_x, delta_y)];
-                if (neighbour->state == SUSCEPTIBLE) {
-                    neighbour->state = INCUBATING;
-                    neighbour->days_in_state = 0;
-#ifdef TRACING
-                    neighbour->infected_by = who;
-#endif
+/* We can record a tree of who was infected by who, as a stream of
+   events written out to a file as we go, rather than as a field in
+   every person_t; that way it costs memory in proportion to the
+   number of infections rather than to the population, and costs
+   nothing at all when it is turned off.  In the real world, someone
+   might be infected by more than one person, of course, so this may
+   not be that useful.
+
+   The file starts with INFECTION_LOG_MAGIC and the population size
+   (as a uint32_t), followed by blocks, each of which is a uint32_t
+   byte count and then that many bytes of events.  Each event is three
+   varints: the day as a difference from the previous event's day, the
+   infector as a zigzag-encoded difference from the previous event's
+   infector, and the infectee as a zigzag-encoded difference from the
+   infector.  The differences start again from zero in each block, so
+   that each sweeping thread can fill its own buffer and write it out
+   as a block whenever it fills up.  People infected at the start have
+   themselves as their infector.  infection_tree.c reads these files. */
+#define INFECTION_LOG_MAGIC "EPILOG1"
+#define INFECTION_LOG_BUFFER_SIZE (64 * 1024)
+/* the most that one event can take, at five bytes per varint: */
+#define INFECTION_LOG_EVENT_MAX 15
+
+typedef struct infection_log_t {
+    FILE *stream;
+    unsigned int previous_day;
+    unsigned int previous_infector;
+    unsigned int fill;
+    unsigned char buffer[INFECTION_LOG_BUFFER_SIZE];
+} infection_log_t;
+
+static infection_log_t *infection_log = NULL;
+
+static infection_log_t *open_infection_log(char *filename, unsigned int population_size) {
+    FILE *stream = fopen(filename, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open infection log file \"%s\"\n", filename);
+        return NULL;
+    }
+    infection_log_t *log = (infection_log_t*)malloc(sizeof(infection_log_t));
+    log->stream = stream;
+    log->previous_day = 0;
+    log->previous_infector = 0;
+    log->fill = 0;
+    fwrite(INFECTION_LOG_MAGIC, 1, sizeof(INFECTION_LOG_MAGIC), stream);
+    uint32_t size = population_size;
+    fwrite(&size, sizeof(size), 1, stream);
+    return log;
+}
+
+static void flush_infection_log(infection_log_t *log) {
+    if (log->fill != 0) {
+        uint32_t length = log->fill;
+        fwrite(&length, sizeof(length), 1, log->stream);
+        fwrite(log->buffer, 1, log->fill, log->stream);
+    }
+    log->fill = 0;
+    log->previous_day = 0;
+    log->previous_infector = 0;
+}
+
+static void close_infection_log(infection_log_t *log) {
+    flush_infection_log(log);
+    fclose(log->stream);
+    free(log);
+}
+
+static void put_varint(infection_log_t *log, uint64_t value) {
+    while (value >= 0x80) {
+        log->buffer[log->fill++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    log->buffer[log->fill++] = (unsigned char)value;
+}
+
+#define Zigzag(_delta_) ((((uint64_t)(_delta_)) << 1) ^ (uint64_t)((_delta_) >> 63))
+
+static void log_infection(infection_log_t *log, unsigned int day, unsigned int infector, unsigned int infectee) {
+    if (contact_network != NULL) {
+        /* log people by their numbers in the network file, not by
+           where the renumbering has put them */
+        infector = contact_network->original_numbers[infector];
+        infectee = contact_network->original_numbers[infectee];
+    }
+    if (log->fill + INFECTION_LOG_EVENT_MAX > INFECTION_LOG_BUFFER_SIZE) {
+        flush_infection_log(log);
+    }
+    put_varint(log, day - log->previous_day);
+    put_varint(log, Zigzag((int64_t)infector - (int64_t)log->previous_infector));
+    put_varint(log, Zigzag((int64_t)infectee - (int64_t)infector));
+    log->previous_day = day;
+    log->previous_infector = infector;
+}
+
+/* For looking at how the epidemic goes in different regions, we can
+   divide the grid into tiles, and count how many people are in each
+   state in each tile, as we go through the grid each day.
+
+   The file starts with TILE_STATS_MAGIC and a tile_stats_header_t,
+   followed by a record for each day, which is the day number (as a
+   uint32_t) and then a uint32_t count for each state (in the order of
+   state_t) for each tile, going across each row of tiles in turn. */
+#define TILE_STATS_MAGIC "EPITILE"
+
+typedef struct tile_stats_header_t {
+    char magic[8];
+    uint32_t grid_width;
+    uint32_t grid_height;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint32_t states;
+} tile_stats_header_t;
+
+typedef struct tile_stats_t {
+    FILE *stream;
+    tile_stats_header_t header;
+    unsigned int row_size;         /* counts in each row of tiles */
+    unsigned int *column_offsets;  /* where each grid column's counts are within its row of tiles */
+    uint32_t *counts;
+} tile_stats_t;
+
+static tile_stats_t *tile_stats = NULL;
+
+#define Tile_Row_Counts(_stats_, _y_) (&(_stats_)->counts[((_y_) / (_stats_)->header.tile_height) * (_stats_)->row_size])
+
+static tile_stats_t *open_tile_stats(char *filename, population_grid_t *population,
+                                     unsigned int tile_width, unsigned int tile_height) {
+    if (tile_width == 0 || tile_height == 0) {
+        fprintf(stderr, "Tiles must be at least one person wide and high\n");
+        return NULL;
+    }
+    FILE *stream = fopen(filename, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open tile stats file \"%s\"\n", filename);
+        return NULL;
+    }
+    tile_stats_t *stats = (tile_stats_t*)malloc(sizeof(tile_stats_t));
+    stats->stream = stream;
+    memset(&stats->header, 0, sizeof(stats->header));
+    memcpy(stats->header.magic, TILE_STATS_MAGIC, sizeof(TILE_STATS_MAGIC));
+    stats->header.grid_width = population->grid_width;
+    stats->header.grid_height = population->grid_height;
+    stats->header.tile_width = tile_width;
+    stats->header.tile_height = tile_height;
+    stats->header.tiles_across = (population->grid_width + tile_width - 1) / tile_width;
+    stats->header.tiles_down = (population->grid_height + tile_height - 1) / tile_height;
+    stats->header.states = N_STATES;
+    stats->row_size = stats->header.tiles_across * N_STATES;
+    stats->column_offsets = (unsigned int*)malloc(population->grid_width * sizeof(unsigned int));
+    for (unsigned int x = 0; x < population->grid_width; x++) {
+        stats->column_offsets[x] = (x / tile_width) * N_STATES;
+    }
+    stats->counts = (uint32_t*)calloc(stats->header.tiles_down * stats->row_size, sizeof(uint32_t));
+    fwrite(&stats->header, sizeof(stats->header), 1, stream);
+    return stats;
+}
+
+/* Someone the sweep has already counted has changed state. */
+static void recount_tile(tile_stats_t *stats, unsigned int who, state_t from, state_t to) {
+    unsigned int y = who / stats->header.grid_width;
+    uint32_t *tile = Tile_Row_Counts(stats, y) + stats->column_offsets[who - y * stats->header.grid_width];
+    tile[from]--;
+    tile[to]++;
+}
+
+static void write_tile_stats(tile_stats_t *stats, unsigned int day) {
+    uint32_t day_number = day;
+    fwrite(&day_number, sizeof(day_number), 1, stats->stream);
+    fwrite(stats->counts, sizeof(uint32_t), stats->header.tiles_down * stats->row_size, stats->stream);
+    memset(stats->counts, 0, stats->header.tiles_down * stats->row_size * sizeof(uint32_t));
+}
+
+static void close_tile_stats(tile_stats_t *stats) {
+    fclose(stats->stream);
+    free(stats->column_offsets);
+    free(stats->counts);
+    free(stats);
+}
+
+/* Pictures of the whole grid every day are expensive for big grids,
+   and most of the grid doesn't change from one day to the next.  So
+   we can instead write a stream of frames in which most days record
+   only the tiles of the grid in which someone has changed state,
+   with a complete keyframe every so often; framedecode turns these
+   back into complete pictures.
+
+   The file starts with FRAME_FILE_MAGIC and a frame_file_header_t,
+   followed by a record for each day, which is a frame_record_t and
+   then, for a keyframe, the states of everyone in the grid; or, for
+   other days, for each changed tile, its number (as a uint32_t) and
+   the states of everyone in it, a row at a time, with places off the
+   edge of the grid as NOBODY.  States are packed two to a byte, the
+   first in the low half. */
+#define FRAME_FILE_MAGIC "EPIFRM1"
+#define FRAME_TILE_SIZE 16
+#define FRAME_TILE_BYTES (FRAME_TILE_SIZE * FRAME_TILE_SIZE / 2)
+
+typedef struct frame_file_header_t {
+    char magic[8];
+    uint32_t grid_width;
+    uint32_t grid_height;
+    uint32_t tile_size;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint32_t keyframe_interval;
+} frame_file_header_t;
+
+#define FRAME_KEY 0
+#define FRAME_DELTA 1
+
+typedef struct frame_record_t {
+    uint32_t day;
+    uint32_t kind;
+    uint32_t tiles;     /* how many tiles follow, for FRAME_DELTA */
+} frame_record_t;
+
+typedef struct frame_stream_t {
+    FILE *stream;
+    frame_file_header_t header;
+    uint8_t *dirty;             /* a flag for each tile */
+    uint32_t *dirty_tiles;      /* the flagged tiles, in the order they were flagged */
+    unsigned int dirty_count;
+    uint8_t *packed;            /* for packing a keyframe into */
+} frame_stream_t;
+
+static frame_stream_t *frames = NULL;
+
+static frame_stream_t *open_frames(char *filename, population_grid_t *population, unsigned int keyframe_interval) {
+    FILE *stream = fopen(filename, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open frames file \"%s\"\n", filename);
+        return NULL;
+    }
+    frame_stream_t *frame_stream = (frame_stream_t*)malloc(sizeof(frame_stream_t));
+    frame_stream->stream = stream;
+    memset(&frame_stream->header, 0, sizeof(frame_stream->header));
+    memcpy(frame_stream->header.magic, FRAME_FILE_MAGIC, sizeof(FRAME_FILE_MAGIC));
+    frame_stream->header.grid_width = population->grid_width;
+    frame_stream->header.grid_height = population->grid_height;
+    frame_stream->header.tile_size = FRAME_TILE_SIZE;
+    frame_stream->header.tiles_across = (population->grid_width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    frame_stream->header.tiles_down = (population->grid_height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    frame_stream->header.keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+    unsigned int tiles = frame_stream->header.tiles_across * frame_stream->header.tiles_down;
+    frame_stream->dirty = (uint8_t*)calloc(tiles, sizeof(uint8_t));
+    frame_stream->dirty_tiles = (uint32_t*)malloc(tiles * sizeof(uint32_t));
+    frame_stream->dirty_count = 0;
+    frame_stream->packed = (uint8_t*)malloc((population->population_size + 1) / 2);
+    fwrite(&frame_stream->header, sizeof(frame_stream->header), 1, stream);
+    return frame_stream;
+}
+
+/* Someone has changed state; note that their tile needs writing out. */
+static void mark_frame_tile(frame_stream_t *frame_stream, unsigned int who) {
+    unsigned int y = who / frame_stream->header.grid_width;
+    unsigned int x = who - y * frame_stream->header.grid_width;
+    unsigned int tile = (y / FRAME_TILE_SIZE) * frame_stream->header.tiles_across + x / FRAME_TILE_SIZE;
+    if (!frame_stream->dirty[tile]) {
+        frame_stream->dirty[tile] = 1;
+        frame_stream->dirty_tiles[frame_stream->dirty_count++] = tile;
+    }
+}
+
+static void write_frame(frame_stream_t *frame_stream, population_grid_t *population, unsigned int day) {
+    frame_record_t record;
+    record.day = day;
+    if (day % frame_stream->header.keyframe_interval == 0) {
+        record.kind = FRAME_KEY;
+        record.tiles = 0;
+        memset(frame_stream->packed, 0, (population->population_size + 1) / 2);
+        for (unsigned int i = 0; i < population->population_size; i++) {
+            frame_stream->packed[i / 2] |= population->population[i].state << ((i & 1) * 4);
+        }
+        fwrite(&record, sizeof(record), 1, frame_stream->stream);
+        fwrite(frame_stream->packed, 1, (population->population_size + 1) / 2, frame_stream->stream);
+    } else {
+        record.kind = FRAME_DELTA;
+        record.tiles = frame_stream->dirty_count;
+        fwrite(&record, sizeof(record), 1, frame_stream->stream);
+        for (unsigned int d = 0; d < frame_stream->dirty_count; d++) {
+            uint32_t tile = frame_stream->dirty_tiles[d];
+            unsigned int left = (tile % frame_stream->header.tiles_across) * FRAME_TILE_SIZE;
+            unsigned int top = (tile / frame_stream->header.tiles_across) * FRAME_TILE_SIZE;
+            uint8_t packed[FRAME_TILE_BYTES];
+            memset(packed, 0, sizeof(packed));
+            for (unsigned int ty = 0; ty < FRAME_TILE_SIZE && top + ty < population->grid_height; ty++) {
+                person_t *row = &population->population[(top + ty) * population->grid_width];
+                for (unsigned int tx = 0; tx < FRAME_TILE_SIZE && left + tx < population->grid_width; tx++) {
+                    unsigned int k = ty * FRAME_TILE_SIZE + tx;
+                    packed[k / 2] |= row[left + tx].state << ((k & 1) * 4);
+                }
+            }
+            fwrite(&tile, sizeof(tile), 1, frame_stream->stream);
+            fwrite(packed, 1, sizeof(packed), frame_stream->stream);
+        }
+    }
+    for (unsigned int d = 0; d < frame_stream->dirty_count; d++) {
+        frame_stream->dirty[frame_stream->dirty_tiles[d]] = 0;
+    }
+    frame_stream->dirty_count = 0;
+}
+
+static void close_frames(frame_stream_t *frame_stream) {
+    fclose(frame_stream->stream);
+    free(frame_stream->dirty);
+    free(frame_stream->dirty_tiles);
+    free(frame_stream->packed);
+    free(frame_stream);
+}
+
+/* How long people stay in each state is picked from a distribution
+   for that state, when they enter it.  Like the spreader grade and age
+   distributors, each of these is an array which we index with a
+   scaled random number, to get a number of days.  States with no
+   distribution (slots == 0) last for ever. */
+typedef struct duration_distributor_t {
+    unsigned int slots;
+    unsigned int *days;
+} duration_distributor_t;
+
+static duration_distributor_t duration_distributors[N_STATES];
+
+/* Rather than counting up the days everyone has spent in their state,
+   we note, when they enter a state, which day they will leave it, on
+   a wheel of lists of people indexed by day.  Then each day we need
+   only look at the people whose time is up.  The wheel must have more
+   slots than the longest duration, so that nobody laps round onto the
+   day being worked through.  Each timer records the state it was set
+   for, so that a timer left over for someone who has since moved on
+   some other way is ignored. */
+typedef struct timer_entry_t {
+    unsigned int who;
+    unsigned int state;
+} timer_entry_t;
+
+typedef struct timer_slot_t {
+    unsigned int fill;
+    unsigned int capacity;
+    timer_entry_t *people;
+} timer_slot_t;
+
+typedef struct timer_wheel_t {
+    unsigned int slot_count;
+    timer_slot_t *slots;
+} timer_wheel_t;
+
+static timer_wheel_t timer_wheel = {0, NULL};
+
+#define Due_On(_day_) (&timer_wheel.slots[(_day_) % timer_wheel.slot_count])
+
+/* Pick how long someone will stay in a state; zero means for ever. */
+static unsigned int draw_duration(state_t state) {
+    duration_distributor_t *distributor = &duration_distributors[state];
+    return (distributor->slots != 0) ? distributor->days[(unsigned int)(drand48() * distributor->slots)] : 0;
+}
+
+/* Put someone into a state, and, if it doesn't last for ever, set a
+   timer for when they are to leave it. */
+static void enter_state(population_grid_t *population, unsigned int who, state_t state, unsigned int day) {
+    population->population[who].state = state;
+    if (frames != NULL) {
+        mark_frame_tile(frames, who);
+    }
+    unsigned int days = draw_duration(state);
+    if (days != 0) {
+        timer_slot_t *slot = Due_On(day + days);
+        if (slot->fill == slot->capacity) {
+            slot->capacity = slot->capacity ? 2 * slot->capacity : 1024;
+            slot->people = (timer_entry_t*)realloc(slot->people, slot->capacity * sizeof(timer_entry_t));
+        }
+        slot->people[slot->fill].who = who;
+        slot->people[slot->fill].state = state;
+        slot->fill++;
+    }
+}
+
+/* Make a duration distributor from a column of weights, one row per
+   number of days.  Durations of less than a day are made into a day,
+   so that nobody is due back on the day they are being dealt with. */
+static void make_duration_distributor(state_t state, double *durations_data, unsigned int rows, unsigned int columns, unsigned int column) {
+    double total_weight = 0;
+    for (unsigned int row = 0; row < rows; row++) {
+        total_weight += durations_data[row * columns + column];
+    }
+    if (total_weight <= 0) {
+        return;
+    }
+    duration_distributor_t *distributor = &duration_distributors[state];
+    distributor->days = (unsigned int*)realloc(distributor->days, DISTRIBUTION_POINTS * sizeof(unsigned int));
+    distributor->slots = 0;
+    for (unsigned int row = 0; row < rows; row++) {
+        unsigned int days = (unsigned int)durations_data[row * columns + 0];
+        unsigned int slots = (unsigned int)(durations_data[row * columns + column] * (double)DISTRIBUTION_POINTS / total_weight);
+        for (unsigned int k = 0;
+             k < slots && distributor->slots < DISTRIBUTION_POINTS;
+             k++) {
+            distributor->days[distributor->slots++] = days ? days : 1;
+        }
+    }
+}
+
+/* Make the wheel big enough for the longest duration in any of the
+   distributors. */
+static void make_timer_wheel() {
+    unsigned int longest = 0;
+    for (unsigned int state = 0; state < N_STATES; state++) {
+        for (unsigned int k = 0; k < duration_distributors[state].slots; k++) {
+            if (duration_distributors[state].days[k] > longest) {
+                longest = duration_distributors[state].days[k];
+            }
+        }
+    }
+    timer_wheel.slot_count = longest + 1;
+    timer_wheel.slots = (timer_slot_t*)calloc(timer_wheel.slot_count, sizeof(timer_slot_t));
+}
+
+static void free_timer_wheel() {
+    for (unsigned int i = 0; i < timer_wheel.slot_count; i++) {
+        free(timer_wheel.slots[i].people);
+    }
+    free(timer_wheel.slots);
+    for (unsigned int state = 0; state < N_STATES; state++) {
+        free(duration_distributors[state].days);
+    }
+}
+
+/* The infection code compares random numbers from lrand48(), which
+   are in the range [0, RANDOM_RANGE), against fixed-point thresholds,
+   rather than doing floating-point arithmetic for each chance. */
+#define RANDOM_RANGE (1U << 31)
+#define Random_Below(_n_) ((unsigned int)(((uint64_t)lrand48() * (_n_)) >> 31))
+
+/* Everything infect() needs to know about a spreader grade, worked
+   out in advance from the grade table, so that the per-person work is
+   just table lookups.  These are rebuilt whenever the R values or
+   travel radii change, which is only at interventions. */
+typedef struct infection_kernel_t {
+    unsigned int attempts;      /* how many chances per day to infect someone */
+    uint32_t *thresholds;       /* the chance of each attempt succeeding, out of RANDOM_RANGE */
+    unsigned int buckets;       /* how many entries in each of x_offsets and y_offsets */
+    int *x_offsets;             /* grid offsets to pick from for the x and y */
+    int *y_offsets;             /* travel, which are added together; zero means picking ourself */
+} infection_kernel_t;
+
+static infection_kernel_t infection_kernels[N_SPREADER_GRADES];
+
+/* The travel distance used to be picked by truncating a uniform
+   random number in [-radius, radius), so zero comes up twice as often
+   as any other distance.  Enumerate the same distribution, for
+   buckets 0 to 2*radius-1: */
+static int travel_bucket(unsigned int bucket, unsigned int radius) {
+    return (bucket < radius) ? ((int)bucket - (int)(radius - 1)) : ((int)bucket - (int)radius);
+}
+
+static void build_infection_kernels(population_grid_t *population, unsigned int grades) {
+    for (unsigned int grade = 0; grade < grades && grade < N_SPREADER_GRADES; grade++) {
+        infection_kernel_t *kernel = &infection_kernels[grade];
+
+        /* Spread the grade's R value over the infectious period in the
+           same sequence of chances as always, but in fixed point: */
+        unsigned int attempts = 0;
+        for (double personal_r = Spreader_R(grade);
+             personal_r / infectious_days >= 0.0;
+             personal_r -= 1.0 / infectious_days) {
+            attempts++;
+        }
+        kernel->thresholds = (uint32_t*)realloc(kernel->thresholds, (attempts + 1) * sizeof(uint32_t));
+        unsigned int attempt = 0;
+        for (double personal_r = Spreader_R(grade);
+             personal_r / infectious_days >= 0.0;
+             personal_r -= 1.0 / infectious_days) {
+            double chance = personal_r / infectious_days;
+            kernel->thresholds[attempt++] = (chance >= 1.0) ? RANDOM_RANGE : (uint32_t)(chance * (double)RANDOM_RANGE);
+        }
+
+        /* Make up how far someone in this grade can go along each
+           axis; the x and y travel are picked independently, so the
+           tables only grow with the radius, not with its square: */
+        unsigned int radius = (unsigned int)Spreader_Radius(grade);
+        int reaches_anyone = 0;
+        kernel->buckets = 2 * radius;
+        kernel->x_offsets = (int*)realloc(kernel->x_offsets, (kernel->buckets + 1) * sizeof(int));
+        kernel->y_offsets = (int*)realloc(kernel->y_offsets, (kernel->buckets + 1) * sizeof(int));
+        for (unsigned int bucket = 0; bucket < kernel->buckets; bucket++) {
+            int travel = travel_bucket(bucket, radius);
+            kernel->x_offsets[bucket] = Grid_Offset(*population, travel, 0);
+            kernel->y_offsets[bucket] = Grid_Offset(*population, 0, travel);
+            if (travel != 0) {
+                reaches_anyone = 1;
+            }
+        }
+
+        /* Someone who can't travel can't infect anyone, so don't
+           bother going through their chances: */
+        kernel->attempts = (reaches_anyone || contact_network != NULL) ? attempts : 0;
+    }
+}
+
+static void free_infection_kernels() {
+    for (unsigned int grade = 0; grade < N_SPREADER_GRADES; grade++) {
+        free(infection_kernels[grade].thresholds);
+        free(infection_kernels[grade].x_offsets);
+        free(infection_kernels[grade].y_offsets);
+    }
+}
+
+/* Pick someone for someone else to meet: either someone within their
+   travel range on the grid, or, on a contact network, one of their
+   contacts in a layer picked by the layer weights.  The layer is
+   picked from just the layers in which they have any contacts, so
+   that someone missing some layers still gets the full value of
+   their chances to infect people.  Picking nobody returns the person
+   themself. */
+static unsigned int pick_contact(population_grid_t *population, unsigned int who, const infection_kernel_t *kernel) {
+    if (contact_network == NULL) {
+        int x_offset = kernel->x_offsets[Random_Below(kernel->buckets)];
+        int y_offset = kernel->y_offsets[Random_Below(kernel->buckets)];
+        return Neighbour(*population, who, x_offset + y_offset);
+    }
+    const uint64_t *rows = &contact_network->row_offsets[(size_t)who * contact_network->layers];
+    uint32_t available_weight = 0;
+    for (unsigned int layer = 0; layer < contact_network->layers; layer++) {
+        if (rows[layer + 1] != rows[layer]) {
+            available_weight += contact_network->layer_weights[layer];
+        }
+    }
+    if (available_weight == 0) {
+        return who;
+    }
+    uint32_t choice = Random_Below(available_weight);
+    unsigned int layer = 0;
+    while (rows[layer + 1] == rows[layer] || choice >= contact_network->layer_weights[layer]) {
+        if (rows[layer + 1] != rows[layer]) {
+            choice -= contact_network->layer_weights[layer];
+        }
+        layer++;
+    }
+    uint64_t count = rows[layer + 1] - rows[layer];
+    return contact_network->contacts[rows[layer] + (((uint64_t)lrand48() * count) >> 31)];
+}
+
+static void infect(unsigned int who, unsigned int day, population_grid_t *population, counts_t *counts) {
+    const infection_kernel_t *kernel = &infection_kernels[population->population[who].spreader_grade];
+    for (unsigned int attempt = 0; attempt < kernel->attempts; attempt++) {
+        if ((uint32_t)lrand48() < kernel->thresholds[attempt]) {
+            /* we're going to infect someone, pick someone we meet */
+            unsigned int neighbour = pick_contact(population, who, kernel);
+            if (neighbour != who) {
+                if (population->population[neighbour].state == SUSCEPTIBLE) {
+                    enter_state(population, neighbour, INCUBATING, day);
+                    if (tile_stats != NULL && neighbour < who) {
+                        /* the sweep has already been past them */
+                        recount_tile(tile_stats, neighbour, SUSCEPTIBLE, INCUBATING);
+                    }
+                    if (infection_log != NULL) {
+                        log_infection(infection_log, day, who, neighbour);
+                    }
                     counts->susceptible--;
                     counts->incubating++;
                 }
             }
         }
-        personal_r -= 1.0 / infectious_days;
     }
 }
 
@@ -373,9 +1391,265 @@ static void infect(unsigned int who, population_grid_t *population, counts_t *co
 #define Intervention_Radius(_i_, _j_)  (interventions_data[(_i_) * interventions_columns + 2 + (2*(_j_) + 1)])
 #define Intervention_Grades()          ((interventions_columns - 2) / 2)
 
+/* Running several replicates of a simulation one after another
+   streams the whole grid through the cache once per replicate per
+   day, for very little arithmetic on each person.  Instead, we can run
+   up to MAX_REPLICATES of them in lockstep over the same people (with
+   the same ages and spreader grades), keeping each person's state in
+   each replicate side by side, so that one pass through the grid
+   advances them all.  The replicates differ only in the random
+   numbers they get.
+
+   A person's state in one replicate is packed into a replicate_lane_t,
+   with the state in the low bits and the number of days left in that
+   state above it, zero meaning for ever.  We count these down as we go
+   through the grid, rather than using the timer wheel.  All of a
+   person's lanes are together, so 32 replicates fill one 64-byte
+   cache line.
+
+   Most people, in most replicates, have nothing happening to them on
+   most days, so we also keep, for each person, a bit-slice across the
+   replicates with a bit set for each replicate in which they are
+   counting down or infectious.  The sweep reads just that word for
+   everyone, and only goes to the lanes of the replicates whose bits
+   are set.  That is all that is saved: each infectious lane still
+   draws its own random numbers for each chance to infect someone, so
+   that the replicates stay independent, and once an epidemic is well
+   under way that work dominates, as it does in a single run. */
+#define MAX_REPLICATES 32
+
+typedef uint16_t replicate_lane_t;
+
+#define LANE_STATE_BITS 4
+#define MAX_LANE_DAYS ((1 << (16 - LANE_STATE_BITS)) - 1)
+#define Lane_State(_lane_) ((_lane_) & ((1 << LANE_STATE_BITS) - 1))
+#define Lane_Days(_lane_) ((_lane_) >> LANE_STATE_BITS)
+#define Make_Lane(_state_, _days_) ((replicate_lane_t)((_state_) | ((_days_) << LANE_STATE_BITS)))
+#define Lane_Infectious(_lane_) (Lane_State(_lane_) == CARRYING || Lane_State(_lane_) == ILL || Lane_State(_lane_) == ASYMPTOMATIC)
+
+typedef struct replicate_set_t {
+    unsigned int replicates;
+    replicate_lane_t *lanes;
+    uint32_t *active;
+} replicate_set_t;
+
+#define Lane_Of(_set_, _who_, _replicate_) ((_set_)->lanes[(size_t)(_who_) * (_set_)->replicates + (_replicate_)])
+
+static void set_lane(replicate_set_t *set, unsigned int who, unsigned int replicate, replicate_lane_t lane) {
+    Lane_Of(set, who, replicate) = lane;
+    if (Lane_Days(lane) != 0 || Lane_Infectious(lane)) {
+        set->active[who] |= (uint32_t)1 << replicate;
+    } else {
+        set->active[who] &= ~((uint32_t)1 << replicate);
+    }
+}
+
+/* Make the lane for someone entering a state.  Someone whom the sweep
+   has yet to reach today gets an extra day, as the sweep will take
+   one off when it gets to them. */
+static replicate_lane_t enter_lane_state(state_t state, unsigned int extra_days) {
+    unsigned int days = draw_duration(state);
+    if (days != 0) {
+        days += extra_days;
+        if (days > MAX_LANE_DAYS) {
+            days = MAX_LANE_DAYS;
+        }
+    }
+    return Make_Lane(state, days);
+}
+
+static void replicate_infect(unsigned int who, unsigned int replicate,
+                             population_grid_t *population, replicate_set_t *set, counts_t *counts) {
+    const infection_kernel_t *kernel = &infection_kernels[population->population[who].spreader_grade];
+    for (unsigned int attempt = 0; attempt < kernel->attempts; attempt++) {
+        if ((uint32_t)lrand48() < kernel->thresholds[attempt]) {
+            unsigned int neighbour = pick_contact(population, who, kernel);
+            if (neighbour != who) {
+                if (Lane_State(Lane_Of(set, neighbour, replicate)) == SUSCEPTIBLE) {
+                    set_lane(set, neighbour, replicate, enter_lane_state(INCUBATING, neighbour > who));
+                    counts->susceptible--;
+                    counts->incubating++;
+                }
+            }
+        }
+    }
+}
+
+/* Run the simulation for all the replicates, writing a row of output
+   for each day with a group of columns for each replicate.  Returns
+   the number of days run. */
+static unsigned int run_replicates(unsigned int replicates, population_grid_t *population, unsigned int people,
+                                   unsigned int cycles, unsigned int starting_cases, unsigned int spreader_grades,
+                                   double *age_data,
+                                   double *interventions_data, unsigned int interventions_count, unsigned int interventions_columns,
+                                   FILE *outstream, telemetry_t *telemetry) {
+    replicate_set_t set;
+    set.replicates = replicates;
+    set.lanes = (replicate_lane_t*)malloc((size_t)population->population_size * replicates * sizeof(replicate_lane_t));
+    set.active = (uint32_t*)calloc(population->population_size, sizeof(uint32_t));
+    counts_t *counts = (counts_t*)calloc(replicates, sizeof(counts_t));
+    counts_t *previous_counts = (counts_t*)calloc(replicates, sizeof(counts_t));
+
+    for (unsigned int i = 0; i < population->population_size; i++) {
+        replicate_lane_t initial = Make_Lane(population->population[i].state == NOBODY ? NOBODY : SUSCEPTIBLE, 0);
+        for (unsigned int r = 0; r < replicates; r++) {
+            Lane_Of(&set, i, r) = initial;
+        }
+    }
+
+    /* Seed each replicate with its own few infectious people: */
+    for (unsigned int r = 0; r < replicates; r++) {
+        counts[r].susceptible = people;
+        for (unsigned int i = 0; i < starting_cases; i++) {
+            unsigned int who;
+            do {
+                who = (unsigned int)(drand48() * population->population_size);
+            } while (Lane_State(Lane_Of(&set, who, r)) != SUSCEPTIBLE);
+            set_lane(&set, who, r, enter_lane_state(INCUBATING, 1));
+            counts[r].susceptible--;
+            counts[r].incubating++;
+        }
+    }
+
+    fprintf(outstream, "Day");
+    for (unsigned int r = 0; r < replicates; r++) {
+        fprintf(outstream, ",Susceptible_%u,Incubating_%u,Carrying_%u,Ill_%u,Recovered_%u,Vaccinated_%u,Died_%u",
+                r, r, r, r, r, r, r);
+    }
+    fprintf(outstream, "\n");
+
+    unsigned int intervention_index = 0;
+    unsigned int stable_days = 0;
+    double run_start = seconds_now();
+    unsigned int day;
+    for (day = 0; day < cycles; day++) {
+        double day_start = seconds_now();
+        if ((interventions_data != NULL)
+            && (intervention_index < interventions_count)
+            && ((double)day > Intervention_Day(intervention_index))) {
+            unsigned int vaccinations = Intervention_Vaccinations(intervention_index);
+            for (unsigned int r = 0; r < replicates; r++) {
+                for (unsigned int i = 0; i < vaccinations; i++) {
+                    unsigned int who = (unsigned int)(drand48() * population->population_size);
+                    if (Lane_State(Lane_Of(&set, who, r)) == SUSCEPTIBLE) {
+                        set_lane(&set, who, r, enter_lane_state(VACCINATED, 1));
+                        counts[r].susceptible--;
+                        counts[r].vaccinated++;
+                    }
+                }
+            }
+            unsigned int affected_grades = Intervention_Grades();
+            for (unsigned int igrade = 0;
+                 igrade < affected_grades;
+                 igrade++) {
+                Spreader_R(igrade) = Intervention_R(intervention_index, igrade);
+                Spreader_Radius(igrade) = Intervention_Radius(intervention_index, igrade);
+            }
+            build_infection_kernels(population, spreader_grades);
+            intervention_index++;
+        }
+
+        double sweep_start = seconds_now();
+        for (unsigned int i = 0; i < population->population_size; i++) {
+            uint32_t pending = set.active[i];
+            while (pending != 0) {
+                unsigned int r = __builtin_ctz(pending);
+                pending &= pending - 1;
+                replicate_lane_t lane = Lane_Of(&set, i, r);
+                unsigned int days = Lane_Days(lane);
+                if (days > 1) {
+                    lane = Make_Lane(Lane_State(lane), days - 1);
+                } else if (days == 1) {
+                    /* time is up for this state */
+                    switch (Lane_State(lane)) {
+                    case INCUBATING:
+                        counts[r].incubating--;
+                        lane = enter_lane_state(CARRYING, 0);
+                        counts[r].carrying++;
+                        break;
+                    case CARRYING:
+                        counts[r].carrying--;
+                        lane = enter_lane_state(ILL, 0);
+                        counts[r].ill++;
+                        break;
+                    case ILL:
+                        counts[r].ill--;
+                        if (drand48() < Age_Mortality(population->population[i].age)) {
+                            lane = enter_lane_state(DIED, 0);
+                            counts[r].died++;
+                        } else {
+                            lane = enter_lane_state(RECOVERED, 0);
+                            counts[r].recovered++;
+                        }
+                        break;
+                    case ASYMPTOMATIC:
+                        counts[r].asymptomatic--;
+                        lane = enter_lane_state(RECOVERED, 0);
+                        counts[r].recovered++;
+                        break;
+                    case RECOVERED:
+                        counts[r].recovered--;
+                        lane = enter_lane_state(SUSCEPTIBLE, 0);
+                        counts[r].susceptible++;
+                        break;
+                    case VACCINATED:
+                        counts[r].vaccinated--;
+                        lane = enter_lane_state(SUSCEPTIBLE, 0);
+                        counts[r].susceptible++;
+                        break;
+                    default:
+                        fprintf(stderr, "Internal error: timer ran out for person %d in state %d in replicate %d\n",
+                                i, Lane_State(lane), r);
+                    }
+                }
+                set_lane(&set, i, r, lane);
+                if (Lane_Infectious(lane)) {
+                    replicate_infect(i, r, population, &set, &counts[r]);
+                }
+            }
+        }
+
+        double output_start = seconds_now();
+        fprintf(outstream, "%d", day);
+        for (unsigned int r = 0; r < replicates; r++) {
+            fprintf(outstream, ",%d,%d,%d,%d,%d,%d,%d",
+                    counts[r].susceptible, counts[r].incubating, counts[r].carrying, counts[r].ill,
+                    counts[r].recovered, counts[r].vaccinated, counts[r].died);
+        }
+        fprintf(outstream, "\n");
+
+        if (telemetry != NULL) {
+            double day_end = seconds_now();
+            publish_telemetry(telemetry, day, &counts[0],
+                              sweep_start - day_start,
+                              0.0, /* lanes change state in the sweep */
+                              output_start - sweep_start,
+                              day_end - output_start,
+                              (double)(day + 1) / (day_end - run_start));
+        }
+
+        if (memcmp(counts, previous_counts, replicates * sizeof(counts_t)) == 0) {
+            stable_days++;
+            if (stable_days > infectious_days) {
+                printf("Equilibrium reached\n");
+                break;
+            }
+        } else {
+            stable_days = 0;
+        }
+        memcpy(previous_counts, counts, replicates * sizeof(counts_t));
+    }
+
+    free(previous_counts);
+    free(counts);
+    free(set.active);
+    free(set.lanes);
+    return day;
+}
+
 #ifdef PRODUCE_IMAGES
 
-static unsigned int RGBs[8][3] = {
+static unsigned int RGBs[N_STATES][3] = {
     {127,127,126}, // NOBODY       0
     {255,255,255}, // SUSCEPTIBLE  1
     {255,105,180}, // INCUBATING   2
@@ -456,7 +1730,7 @@ int writeImage(char* filename,
         for (y=0 ; y<grid->grid_height ; y++) {
                 for (x=0 ; x<grid->grid_width ; x++) {
                     png_byte *ptr = &(row[x*3]);
-                    unsigned int *colour = RGBs[grid->population[y*grid->grid_width + x].state % 8];
+                    unsigned int *colour = RGBs[grid->population[y*grid->grid_width + x].state % N_STATES];
                     ptr[0] = colour[0];
                     ptr[1] = colour[1];
                     ptr[2] = colour[2];
@@ -486,10 +1760,24 @@ int main(int argc, char **argv) {
   unsigned int carrying_days = 5;
   unsigned int ill_days = 10;
   unsigned int asymptomatic_days = 20;
+  char *durations_file = NULL;
 
   char *spreader_grades_file = NULL;
   char *age_distribution_file = NULL;
   char *interventions_file = NULL;
+  char *population_file = NULL;
+  char *network_file = NULL;
+  double layer_weights[MAX_CONTACT_LAYERS];
+  unsigned int layer_weights_given = 0;
+  char *telemetry_name = NULL;
+  unsigned int tile_width = 0;
+  unsigned int tile_height = 0;
+  char *tile_stats_file = "tiles.dat";
+  unsigned int replicates = 1;
+  char *frames_file = NULL;
+  unsigned int keyframe_interval = 30;
+  telemetry_t *telemetry = NULL;
+  char *infection_log_file = NULL;
 
   population_grid_t population = {1024 * 1024, 1024, 1024};
   counts_t counts = {0, 0, 0, 0, 0, 0, 0};
@@ -521,6 +1809,9 @@ int main(int argc, char **argv) {
     case 'c':
         cycles = atoi(optarg);
         break;
+    case 'd':
+        durations_file = optarg;
+        break;
     case 'h':
         print_usage();
         exit(0);
@@ -564,9 +1855,44 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Image output not compiled into this version\n");
 #endif
         break;
+    case 'r':
+        replicates = atoi(optarg);
+        if (replicates < 1 || replicates > MAX_REPLICATES) {
+            fprintf(stderr, "Can run from 1 to %d replicates at once\n", MAX_REPLICATES);
+            exit(1);
+        }
+        break;
     case 'R':
         reproduction_rate = atof(optarg);
         break;
+    case 'F':
+        frames_file = optarg;
+        break;
+    case 'k':
+        keyframe_interval = atoi(optarg);
+        break;
+    case 'f':
+        population_file = optarg;
+        break;
+    case 'n':
+        network_file = optarg;
+        break;
+    case 'L': {
+        char *weight = optarg;
+        layer_weights_given = 0;
+        while (*weight != '\0' && layer_weights_given < MAX_CONTACT_LAYERS) {
+            layer_weights[layer_weights_given] = strtod(weight, &weight);
+            if (!(layer_weights[layer_weights_given] >= 0.0) || isinf(layer_weights[layer_weights_given])) {
+                fprintf(stderr, "Layer weights must be zero or more\n");
+                exit(1);
+            }
+            layer_weights_given++;
+            if (*weight == ',') {
+                weight++;
+            }
+        }
+        break;
+    }
     case 'g':
         spreader_grades_file = optarg;
         break;
@@ -576,12 +1902,32 @@ int main(int argc, char **argv) {
     case 'I':
         interventions_file = optarg;
         break;
+    case 'l':
+        infection_log_file = optarg;
+        break;
+    case 't':
+        if (sscanf(optarg, "%ux%u", &tile_width, &tile_height) != 2) {
+            fprintf(stderr, "Tile size should be given as WIDTHxHEIGHT\n");
+            exit(1);
+        }
+        break;
+    case 'O':
+        tile_stats_file = optarg;
+        break;
+    case 'T':
+        telemetry_name = optarg;
+        break;
     case 'v':
         verbose = 1;
         break;
     }
   }
 
+  if (replicates > 1 && (infection_log_file != NULL || tile_width != 0 || frames_file != NULL)) {
+      fprintf(stderr, "The infection log, tile stats and frames are not available when running replicates\n");
+      exit(1);
+  }
+
 #ifdef PRODUCE_IMAGES
   image_filename_buffer = (char*)malloc(strlen(image_filename_format + 4));
 #endif
@@ -661,27 +2007,115 @@ int main(int argc, char **argv) {
       }
   }
   
-  /* Adjust size to fit a convenient squarish grid */
-  population.grid_width = (int)floor(sqrtf((float)population.population_size));
-  population.grid_height = population.population_size / population.grid_width;
-  population.population_size = population.grid_height * population.grid_width;
+  /* The number of people, which may be fewer than the number of grid
+     cells when the population comes from a file: */
+  unsigned int people;
+
+  if (network_file) {
+      contact_network = load_contact_network(network_file, layer_weights, layer_weights_given);
+      if (contact_network == NULL) {
+          exit(1);
+      }
+  }
+
+  if (population_file) {
+      people = load_population(population_file, &population, contact_network == NULL);
+      if (people == 0) {
+          exit(1);
+      }
+      if (contact_network != NULL) {
+          /* Person i in the file is vertex i in the network, which
+             has been renumbered. */
+          if (people != contact_network->vertices) {
+              fprintf(stderr, "Population has %u people but the network has %u\n", people, contact_network->vertices);
+              exit(1);
+          }
+          person_t *in_file_order = (person_t*)malloc(people * sizeof(person_t));
+          memcpy(in_file_order, population.population, people * sizeof(person_t));
+          for (unsigned int v = 0; v < people; v++) {
+              population.population[contact_network->renumbering[v]] = in_file_order[v];
+          }
+          free(in_file_order);
+      }
+  } else if (contact_network != NULL) {
+      /* Lay the network's people out on a squarish grid, for pictures
+         and tile counts, leaving any cells left over empty: */
+      people = contact_network->vertices;
+      population.grid_width = (unsigned int)floor(sqrt((double)people));
+      population.grid_height = (people + population.grid_width - 1) / population.grid_width;
+      population.population_size = population.grid_height * population.grid_width;
+
+      population.population = (person_t*)malloc(population.population_size*sizeof(person_t));
+
+      for (int i = 0; i < population.population_size; i++) {
+          population.population[i].state = (i < people) ? SUSCEPTIBLE : NOBODY;
+          population.population[i].spreader_grade = grade_distributor[(unsigned int)(drand48() * top_grade_slot)];
+          population.population[i].age = age_distributor[(unsigned int)(drand48() * top_age_slot)];
+      }
+  } else {
+      /* Adjust size to fit a convenient squarish grid */
+      population.grid_width = (int)floor(sqrtf((float)population.population_size));
+      population.grid_height = population.population_size / population.grid_width;
+      population.population_size = population.grid_height * population.grid_width;
+      people = population.population_size;
 
-  population.population = (person_t*)malloc(population.population_size*sizeof(person_t));
+      population.population = (person_t*)malloc(population.population_size*sizeof(person_t));
 
-  for (int i = 0; i < population.population_size; i++) {
-    population.population[i].state = SUSCEPTIBLE;
-    population.population[i].spreader_grade = grade_distributor[(unsigned int)(drand48() * top_grade_slot)];
-    population.population[i].age = age_distributor[(unsigned int)(drand48() * top_age_slot)];
+      for (int i = 0; i < population.population_size; i++) {
+          population.population[i].state = SUSCEPTIBLE;
+          population.population[i].spreader_grade = grade_distributor[(unsigned int)(drand48() * top_grade_slot)];
+          population.population[i].age = age_distributor[(unsigned int)(drand48() * top_age_slot)];
+      }
   }
 
   free(age_distributor);
   free(grade_distributor);
 
-  /* Seed with a few infectious people: */
-  for (int i = 0; i < starting_cases; i++) {
-      person_t *person = &population.population[(int)(drand48() * population.population_size)];
-      person->days_in_state = 0;
-      person->state = INCUBATING;
+  build_infection_kernels(&population, spreader_grades);
+
+  /* Read the distributions of how long people stay in each state.
+     The columns are:
+     * The number of days
+     * The relative likelihood of staying that long in each of the
+       states INCUBATING, ASYMPTOMATIC, CARRYING, ILL, RECOVERED and
+       VACCINATED, in that order.
+     Columns that are missing, or all zero, keep the defaults below,
+     in which RECOVERED and VACCINATED last for ever; giving those a
+     distribution makes immunity wane, so people become SUSCEPTIBLE
+     again.  People start infecting others on the day they become
+     CARRYING, whereas the old fixed durations let them start only the
+     day after, so the built-in incubation gets an extra day to keep
+     the same time from being infected to infecting others. */
+  double default_durations_data[] = {
+      incubation_days + 1, 1, 0, 0, 0,
+      carrying_days,     0, 1, 0, 0,
+      ill_days,          0, 0, 1, 0,
+      asymptomatic_days, 0, 0, 0, 1
+  };
+  make_duration_distributor(INCUBATING, default_durations_data, 4, 5, 1);
+  make_duration_distributor(CARRYING, default_durations_data, 4, 5, 2);
+  make_duration_distributor(ILL, default_durations_data, 4, 5, 3);
+  make_duration_distributor(ASYMPTOMATIC, default_durations_data, 4, 5, 4);
+  if (durations_file) {
+      double *durations_data;
+      unsigned int durations_rows;
+      unsigned int durations_columns;
+      read_table(durations_file, &durations_data, &durations_rows, &durations_columns, 0);
+      for (unsigned int column = 1;
+           column < durations_columns && column <= VACCINATED - INCUBATING + 1;
+           column++) {
+          make_duration_distributor(INCUBATING + column - 1, durations_data, durations_rows, durations_columns, column);
+      }
+      free(durations_data);
+  }
+  make_timer_wheel();
+
+  if (infection_log_file) {
+      infection_log = open_infection_log(infection_log_file, population.population_size);
+  }
+
+  if (starting_cases > people) {
+      starting_cases = people;
   }
 
   double *interventions_data = NULL;
@@ -691,150 +2125,252 @@ int main(int argc, char **argv) {
   if (interventions_file) {
       read_table(interventions_file, &interventions_data, &interventions_count, &interventions_columns, 1);
   }
-  
-  counts.incubating = starting_cases;
-  counts.susceptible = population.population_size - starting_cases;
 
-  unsigned int stable_days = 0;
-  
-  fprintf(outstream, "Day,Susceptible,Incubating,Carrying,Ill,Recovered,Vaccinated,Died\n");
+  /* Anything that can fail after this must close the telemetry block
+     before giving up, or the name can't be used again: */
+  if (telemetry_name) {
+      telemetry = open_telemetry(telemetry_name, population.population_size, cycles);
+      if (telemetry == NULL) {
+          exit(1);
+      }
+  }
 
   unsigned int day;
-  for (day = 0; day < cycles; day++) {
-      if ((interventions_data != NULL)
-          && ((double)day > Intervention_Day(intervention_index))) {
-          unsigned int vaccinations = Intervention_Vaccinations(intervention_index);
-          for (unsigned int i = 0; i < vaccinations; i++) {
-              unsigned int who = (unsigned int)(drand48() * population.population_size);
-              if (population.population[who].state == SUSCEPTIBLE) {
-                  population.population[who].state = VACCINATED;
-                  counts.susceptible--;
-                  counts.vaccinated++;
+  if (replicates > 1) {
+      day = run_replicates(replicates, &population, people, cycles, starting_cases, spreader_grades,
+                           age_data,
+                           interventions_data, interventions_count, interventions_columns,
+                           outstream, telemetry);
+  } else {
+      if (frames_file) {
+          frames = open_frames(frames_file, &population, keyframe_interval);
+          if (frames == NULL) {
+              if (telemetry != NULL) {
+                  close_telemetry(telemetry, telemetry_name);
               }
+              exit(1);
           }
-          unsigned int affected_grades = Intervention_Grades();
-          for (unsigned int igrade = 0;
-               igrade < affected_grades;
-               igrade++) {
-              Spreader_R(igrade) = Intervention_R(intervention_index, igrade);
-              Spreader_Radius(igrade) = Intervention_Radius(intervention_index, igrade);
+      }
+
+      /* Seed with a few infectious people: */
+      for (int i = 0; i < starting_cases; i++) {
+          unsigned int who;
+          do {
+              who = (unsigned int)(drand48() * population.population_size);
+          } while (population.population[who].state != SUSCEPTIBLE);
+          enter_state(&population, who, INCUBATING, 0);
+          if (infection_log != NULL) {
+              log_infection(infection_log, 0, who, who);
           }
-          intervention_index++;
       }
-      for (int i = 0; i < population.population_size; i++) {
-          switch (population.population[i].state) {
-          case NOBODY:
-          case RECOVERED:
-          case VACCINATED:
-              /* might be losing immunity, although we don't handle that yet */
-              population.population[i].days_in_state++;
-              break;
-          case DIED:
-          case SUSCEPTIBLE:
-              /* nothing to do in these cases */
-              break;
-          case INCUBATING:
-              /* not yet infectious */
-              population.population[i].days_in_state++;
-              /* TODO: check against a distribution of days in this state */
-              if (population.population[i].days_in_state > incubation_days) {
+
+      counts.incubating = starting_cases;
+      counts.susceptible = people - starting_cases;
+
+      unsigned int stable_days = 0;
+  
+      fprintf(outstream, "Day,Susceptible,Incubating,Carrying,Ill,Recovered,Vaccinated,Died\n");
+
+      if (tile_width != 0) {
+          tile_stats = open_tile_stats(tile_stats_file, &population, tile_width, tile_height);
+          if (tile_stats == NULL) {
+              if (telemetry != NULL) {
+                  close_telemetry(telemetry, telemetry_name);
+              }
+              exit(1);
+          }
+      }
+
+      double run_start = seconds_now();
+
+      for (day = 0; day < cycles; day++) {
+          double day_start = seconds_now();
+          if ((interventions_data != NULL)
+              && (intervention_index < interventions_count)
+              && ((double)day > Intervention_Day(intervention_index))) {
+              unsigned int vaccinations = Intervention_Vaccinations(intervention_index);
+              for (unsigned int i = 0; i < vaccinations; i++) {
+                  unsigned int who = (unsigned int)(drand48() * population.population_size);
+                  if (population.population[who].state == SUSCEPTIBLE) {
+                      enter_state(&population, who, VACCINATED, day);
+                      counts.susceptible--;
+                      counts.vaccinated++;
+                  }
+              }
+              unsigned int affected_grades = Intervention_Grades();
+              for (unsigned int igrade = 0;
+                   igrade < affected_grades;
+                   igrade++) {
+                  Spreader_R(igrade) = Intervention_R(intervention_index, igrade);
+                  Spreader_Radius(igrade) = Intervention_Radius(intervention_index, igrade);
+              }
+              build_infection_kernels(&population, spreader_grades);
+              intervention_index++;
+          }
+          double transition_start = seconds_now();
+          /* Move on everyone whose time in their state is up: */
+          timer_slot_t *due = Due_On(day);
+          for (unsigned int d = 0; d < due->fill; d++) {
+              unsigned int i = due->people[d].who;
+              if (population.population[i].state != due->people[d].state) {
+                  continue;
+              }
+              switch (population.population[i].state) {
+              case INCUBATING: {
                   int asymptomatic = 0; /* TODO: derive this from random and the spreader grade */
-                  population.population[i].state = asymptomatic ? CARRYING : ASYMPTOMATIC;
-                  population.population[i].days_in_state = 0;
                   counts.incubating--;
                   if (asymptomatic) {
-M4ck3r3lEmacsLuleshtrydhe                      counts.asymptomatic++;
+                      enter_state(&population, i, ASYMPTOMATIC, day);
+                      counts.asymptomatic++;
                   } else {
+                      enter_state(&population, i, CARRYING, day);
                       counts.carrying++;
                   }
+                  break;
               }
-              break;
-          case CARRYING:
-              /* TODO: check against a distribution of days in this state */
-              population.population[i].days_in_state++;
-              if (population.population[i].days_in_state > carrying_days) {
-                  population.population[i].state = ILL;
-                  population.population[i].days_in_state = 0;
+              case CARRYING:
+                  enter_state(&population, i, ILL, day);
                   counts.carrying--;
                   counts.ill++;
-              } else {
-                  infect(i, &population, &counts);
-              }
-              break;
-          case ILL:
-              /* TODO: check against a distribution of days in this state */
-              population.population[i].days_in_state++;
-              if (population.population[i].days_in_state > ill_days) {
-                  population.population[i].days_in_state = 0;
+                  break;
+              case ILL:
                   counts.ill--;
                   if (drand48() < Age_Mortality(population.population[i].age)) {
-                      population.population[i].state = DIED;
+                      enter_state(&population, i, DIED, day);
                       counts.died++;
                   } else {
-                      population.population[i].state = RECOVERED;
+                      enter_state(&population, i, RECOVERED, day);
                       counts.recovered++;
                   }
-              } else {
-                  infect(i, &population, &counts);
-              }
-              break;
-          case ASYMPTOMATIC:
-              /* TODO: check against a distribution of days in this state */
-              population.population[i].days_in_state++;
-              if (population.population[i].days_in_state > asymptomatic_days) {
-                  population.population[i].days_in_state = 0;
+                  break;
+              case ASYMPTOMATIC:
                   counts.asymptomatic--;
-                  population.population[i].state = RECOVERED;
+                  enter_state(&population, i, RECOVERED, day);
                   counts.recovered++;
-              } else {
-                  infect(i, &population, &counts);
+                  break;
+              case RECOVERED:
+                  /* immunity has worn off */
+                  counts.recovered--;
+                  enter_state(&population, i, SUSCEPTIBLE, day);
+                  counts.susceptible++;
+                  break;
+              case VACCINATED:
+                  counts.vaccinated--;
+                  enter_state(&population, i, SUSCEPTIBLE, day);
+                  counts.susceptible++;
+                  break;
+              default:
+                  fprintf(stderr, "Internal error: timer ran out for person %d in state %d\n", i, population.population[i].state);
               }
-              break;
-          default:
-              fprintf(stderr, "Internal error: bad state %d in person %d\n", population.population[i].state, i);
           }
-      }
-      if ((counts.susceptible + counts.incubating + counts.carrying + counts.ill
-           + counts.recovered + counts.vaccinated + counts.died) != population.population_size) {
-          printf("Warning: miscount: ");
-      }
-      fprintf(outstream, "%d,%d,%d,%d,%d,%d,%d,%d\n",
-              day,
-              counts.susceptible, counts.incubating, counts.carrying, counts.ill,
-              counts.recovered, counts.vaccinated, counts.died);
+          due->fill = 0;
+
+          double sweep_start = seconds_now();
+          /* Go through the grid row by row, so that we can keep the tile
+             counts as we go without having to work out where everyone is. */
+          unsigned int i = 0;
+          for (unsigned int y = 0; y < population.grid_height; y++) {
+              uint32_t *tile_row = (tile_stats != NULL) ? Tile_Row_Counts(tile_stats, y) : NULL;
+              for (unsigned int x = 0; x < population.grid_width; x++, i++) {
+                  unsigned int state = population.population[i].state;
+                  if (tile_row != NULL) {
+                      tile_row[tile_stats->column_offsets[x] + state]++;
+                  }
+                  switch (state) {
+                  case NOBODY:
+                  case SUSCEPTIBLE:
+                  case INCUBATING:
+                  case RECOVERED:
+                  case VACCINATED:
+                  case DIED:
+                      /* nothing to do in these cases */
+                      break;
+                  case CARRYING:
+                  case ILL:
+                  case ASYMPTOMATIC:
+                      infect(i, day, &population, &counts);
+                      break;
+                  default:
+                      fprintf(stderr, "Internal error: bad state %d in person %d\n", state, i);
+                  }
+              }
+          }
+          if ((counts.susceptible + counts.incubating + counts.asymptomatic + counts.carrying + counts.ill
+               + counts.recovered + counts.vaccinated + counts.died) != people) {
+              printf("Warning: miscount: ");
+          }
+          double output_start = seconds_now();
+          if (tile_stats != NULL) {
+              write_tile_stats(tile_stats, day);
+          }
+          if (frames != NULL) {
+              write_frame(frames, &population, day);
+          }
+          fprintf(outstream, "%d,%d,%d,%d,%d,%d,%d,%d\n",
+                  day,
+                  counts.susceptible, counts.incubating, counts.carrying, counts.ill,
+                  counts.recovered, counts.vaccinated, counts.died);
 
 #ifdef PRODUCE_IMAGES
-      sprintf(image_filename_buffer, image_filename_format, day);
-      sprintf(title_buffer, "Day %d", day);
-      writeImage(image_filename_buffer,
-                 &population,
-                 title_buffer);
+          sprintf(image_filename_buffer, image_filename_format, day);
+          sprintf(title_buffer, "Day %d", day);
+          writeImage(image_filename_buffer,
+                     &population,
+                     title_buffer);
 #endif
 
-      if (counts.susceptible == previous_counts.susceptible
-          && counts.incubating == previous_counts.incubating
-          && counts.carrying == previous_counts.carrying
-          && counts.ill == previous_counts.ill
-          && counts.recovered == previous_counts.recovered
-          && counts.vaccinated == previous_counts.vaccinated
-          && counts.died == previous_counts.died) {
-          stable_days++;
-          if (stable_days > infectious_days) {
-              printf("Equilibrium reached\n");
-              break;
+          if (telemetry != NULL) {
+              double day_end = seconds_now();
+              publish_telemetry(telemetry, day, &counts,
+                                transition_start - day_start,
+                                sweep_start - transition_start,
+                                output_start - sweep_start,
+                                day_end - output_start,
+                                (double)(day + 1) / (day_end - run_start));
           }
-      } else {
-          stable_days = 0;
+
+          if (counts.susceptible == previous_counts.susceptible
+              && counts.incubating == previous_counts.incubating
+              && counts.carrying == previous_counts.carrying
+              && counts.ill == previous_counts.ill
+              && counts.recovered == previous_counts.recovered
+              && counts.vaccinated == previous_counts.vaccinated
+              && counts.died == previous_counts.died) {
+              stable_days++;
+              if (stable_days > infectious_days) {
+                  printf("Equilibrium reached\n");
+                  break;
+              }
+          } else {
+              stable_days = 0;
+          }
+          previous_counts = counts;
       }
-      previous_counts = counts;
   }
   if (outstream != stdout) {
       fclose(outstream);
   }
+  if (infection_log != NULL) {
+      close_infection_log(infection_log);
+  }
+  if (telemetry != NULL) {
+      close_telemetry(telemetry, telemetry_name);
+  }
+  if (tile_stats != NULL) {
+      close_tile_stats(tile_stats);
+  }
+  if (frames != NULL) {
+      close_frames(frames);
+  }
   if (interventions_data) {
       free(interventions_data);
   }
   free(population.population);
+  free_infection_kernels();
+  if (contact_network != NULL) {
+      free_contact_network(contact_network);
+  }
+  free_timer_wheel();
   if (age_data != default_age_data) {
       free(age_data);
   }
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+
+/* Watch a running "epidemic --telemetry name", printing a line about
+   its progress every few seconds, until it finishes or dies.
+
+   See the comment by TELEMETRY_MAGIC in epidemic.c for how the
+   telemetry block is shared. */
+
+#define TELEMETRY_MAGIC 0x45504954
+
+/* These must match the definitions in epidemic.c: */
+typedef struct counts_t {
+    unsigned int susceptible;
+    unsigned int incubating;
+    unsigned int asymptomatic;
+    unsigned int carrying;
+    unsigned int ill;
+    unsigned int recovered;
+    unsigned int vaccinated;
+    unsigned int died;
+} counts_t;
+
+typedef struct telemetry_t {
+    uint32_t magic;
+    _Atomic uint32_t sequence;
+    int32_t pid;
+    uint32_t finished;
+    uint32_t population_size;
+    uint32_t cycles;
+    uint32_t day;
+    counts_t counts;
+    double intervention_seconds;
+    double transition_seconds;
+    double sweep_seconds;
+    double output_seconds;
+    double days_per_second;
+    uint64_t resident_bytes;
+} telemetry_t;
+
+/* Take a consistent copy of the telemetry block, waiting for any
+   update in progress to finish.  If the writer died in the middle of
+   an update, the update never finishes, so we check now and then that
+   it is still there.  Returns 0 if it has gone. */
+static int read_telemetry(telemetry_t *shared, telemetry_t *copy) {
+    for (unsigned int tries = 1; ; tries++) {
+        uint32_t before = atomic_load_explicit(&shared->sequence, memory_order_acquire);
+        if ((before & 1) == 0) {
+            memcpy((char*)copy, (char*)shared, sizeof(telemetry_t));
+            atomic_thread_fence(memory_order_acquire);
+            uint32_t after = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+            if (before == after) {
+                return 1;
+            }
+        }
+        if (tries % 1000 == 0 && kill(shared->pid, 0) != 0 && errno == ESRCH) {
+            return 0;
+        }
+        usleep(100);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage:\n  epidemic_top name [seconds]\n");
+        exit(1);
+    }
+    unsigned int interval = (argc == 3) ? atoi(argv[2]) : 2;
+    if (interval == 0) {
+        interval = 1;
+    }
+    char *shm_name = (char*)malloc(strlen(argv[1]) + 2);
+    sprintf(shm_name, "/%s", argv[1]);
+    int filedesc = shm_open(shm_name, O_RDONLY, 0);
+    free(shm_name);
+    if (filedesc == -1) {
+        fprintf(stderr, "No telemetry block called \"%s\"\n", argv[1]);
+        exit(1);
+    }
+    telemetry_t *shared = (telemetry_t*)mmap(NULL, sizeof(telemetry_t), PROT_READ, MAP_SHARED, filedesc, 0);
+    close(filedesc);
+    if (shared == MAP_FAILED || shared->magic != TELEMETRY_MAGIC) {
+        fprintf(stderr, "\"%s\" is not an epidemic telemetry block\n", argv[1]);
+        exit(1);
+    }
+
+    printf("   Day/Cycles   Days/s  Interv ms  Timers ms   Sweep ms  Output ms  RSS MB  Susceptible  Incubating    Carrying         Ill   Recovered  Vaccinated        Died\n");
+    unsigned int last_day = 0;
+    unsigned int unchanged = 0;
+    while (1) {
+        telemetry_t telemetry;
+        if (!read_telemetry(shared, &telemetry)) {
+            printf("Process %d has gone away in the middle of an update\n", shared->pid);
+            break;
+        }
+        if (telemetry.day != last_day) {
+            last_day = telemetry.day;
+            unchanged = 0;
+        } else {
+            unchanged += interval;
+        }
+        printf("%6u/%-6u %8.3f %10.1f %10.1f %10.1f %10.1f %7.0f %12u %11u %11u %11u %11u %11u %11u%s\n",
+               telemetry.day, telemetry.cycles,
+               telemetry.days_per_second,
+               telemetry.intervention_seconds * 1000.0,
+               telemetry.transition_seconds * 1000.0,
+               telemetry.sweep_seconds * 1000.0,
+               telemetry.output_seconds * 1000.0,
+               (double)telemetry.resident_bytes / (1024.0 * 1024.0),
+               telemetry.counts.susceptible, telemetry.counts.incubating,
+               telemetry.counts.carrying, telemetry.counts.ill,
+               telemetry.counts.recovered, telemetry.counts.vaccinated,
+               telemetry.counts.died,
+               (telemetry.days_per_second > 0 && unchanged > 10.0 / telemetry.days_per_second + interval)
+               ? "  (stalled?)" : "");
+        fflush(stdout);
+        if (telemetry.finished) {
+            printf("Finished\n");
+            break;
+        }
+        if (kill(telemetry.pid, 0) != 0 && errno == ESRCH) {
+            printf("Process %d has gone away without finishing\n", telemetry.pid);
+            break;
+        }
+        sleep(interval);
+    }
+    munmap(shared, sizeof(telemetry_t));
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Rebuild complete pictures from a frames file written by
+   "epidemic --frames", writing one PPM file for each day.
+
+   See the comment by FRAME_FILE_MAGIC in epidemic.c for the format
+   of the frames file. */
+
+#define FRAME_FILE_MAGIC "EPIFRM1"
+
+typedef struct frame_file_header_t {
+    char magic[8];
+    uint32_t grid_width;
+    uint32_t grid_height;
+    uint32_t tile_size;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint32_t keyframe_interval;
+} frame_file_header_t;
+
+#define FRAME_KEY 0
+#define FRAME_DELTA 1
+
+typedef struct frame_record_t {
+    uint32_t day;
+    uint32_t kind;
+    uint32_t tiles;
+} frame_record_t;
+
+/* These should match the colours in epidemic.c's writeImage: */
+static unsigned char RGBs[16][3] = {
+    {127,127,126}, // NOBODY       0
+    {255,255,255}, // SUSCEPTIBLE  1
+    {255,105,180}, // INCUBATING   2
+    {127,127,127}, // ASYMPTOMATIC 3
+    {255,165,0},   // CARRYING     4
+    {255,0,0},     // ILL          5
+    {0,255,0},     // RECOVERED    6
+    {0,0,255},     // VACCINATED   7
+    {0,0,0},       // DIED         8
+};
+
+#define Unpack(_packed_, _k_) (((_packed_)[(_k_) / 2] >> (((_k_) & 1) * 4)) & 0xf)
+
+static int write_picture(char *filename, frame_file_header_t *header, uint8_t *states, unsigned char *row) {
+    FILE *stream = fopen(filename, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open picture file \"%s\" for writing\n", filename);
+        return 1;
+    }
+    fprintf(stream, "P6\n%u %u\n255\n", header->grid_width, header->grid_height);
+    for (unsigned int y = 0; y < header->grid_height; y++) {
+        for (unsigned int x = 0; x < header->grid_width; x++) {
+            memcpy(&row[x * 3], RGBs[states[(size_t)y * header->grid_width + x]], 3);
+        }
+        fwrite(row, 3, header->grid_width, stream);
+    }
+    fclose(stream);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage:\n  framedecode framefile [picture-filename-format]\n");
+        exit(1);
+    }
+    char *picture_filename_format = (argc == 3) ? argv[2] : "day-%03d.ppm";
+    FILE *stream = fopen(argv[1], "rb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open frames file \"%s\"\n", argv[1]);
+        exit(1);
+    }
+    frame_file_header_t header;
+    if (fread(&header, sizeof(header), 1, stream) != 1
+        || memcmp(header.magic, FRAME_FILE_MAGIC, sizeof(FRAME_FILE_MAGIC)) != 0) {
+        fprintf(stderr, "\"%s\" is not a frames file\n", argv[1]);
+        exit(1);
+    }
+
+    size_t cells = (size_t)header.grid_width * header.grid_height;
+    unsigned int tile_cells = header.tile_size * header.tile_size;
+    uint8_t *states = (uint8_t*)calloc(cells, 1);
+    uint8_t *packed = (uint8_t*)malloc((cells + 1) / 2);
+    uint8_t *tile_packed = (uint8_t*)malloc(tile_cells / 2);
+    unsigned char *row = (unsigned char*)malloc(header.grid_width * 3);
+    char *filename = (char*)malloc(strlen(picture_filename_format) + 32);
+    int have_keyframe = 0;
+    unsigned int pictures = 0;
+
+    frame_record_t record;
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+        if (record.kind == FRAME_KEY) {
+            if (fread(packed, 1, (cells + 1) / 2, stream) != (cells + 1) / 2) {
+                fprintf(stderr, "Frames file \"%s\" is truncated\n", argv[1]);
+                break;
+            }
+            for (size_t k = 0; k < cells; k++) {
+                states[k] = Unpack(packed, k);
+            }
+            have_keyframe = 1;
+        } else {
+            if (!have_keyframe) {
+                fprintf(stderr, "Frames file \"%s\" does not start with a keyframe\n", argv[1]);
+                exit(1);
+            }
+            for (unsigned int t = 0; t < record.tiles; t++) {
+                uint32_t tile;
+                if (fread(&tile, sizeof(tile), 1, stream) != 1
+                    || fread(tile_packed, 1, tile_cells / 2, stream) != tile_cells / 2) {
+                    fprintf(stderr, "Frames file \"%s\" is truncated\n", argv[1]);
+                    exit(1);
+                }
+                unsigned int left = (tile % header.tiles_across) * header.tile_size;
+                unsigned int top = (tile / header.tiles_across) * header.tile_size;
+                for (unsigned int ty = 0; ty < header.tile_size && top + ty < header.grid_height; ty++) {
+                    for (unsigned int tx = 0; tx < header.tile_size && left + tx < header.grid_width; tx++) {
+                        states[(size_t)(top + ty) * header.grid_width + left + tx] = Unpack(tile_packed, ty * header.tile_size + tx);
+                    }
+                }
+            }
+        }
+        sprintf(filename, picture_filename_format, record.day);
+        if (write_picture(filename, &header, states, row) != 0) {
+            exit(1);
+        }
+        pictures++;
+    }
+    fclose(stream);
+    printf("Wrote %u pictures\n", pictures);
+
+    free(filename);
+    free(row);
+    free(tile_packed);
+    free(packed);
+    free(states);
+    return 0;
+}
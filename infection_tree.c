@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Read an infection log written by "epidemic --infection-log" and
+   output how many people were infected in each generation, and the
+   distribution of how many people each infected person went on to
+   infect.
+
+   See the comment by INFECTION_LOG_MAGIC in epidemic.c for the file
+   format. */
+
+#define INFECTION_LOG_MAGIC "EPILOG1"
+
+/* Marks people who don't appear in the log as having been infected: */
+#define NOT_INFECTED 0xffffffff
+
+/* Marks people whose generation we are still working out: */
+#define UNKNOWN_GENERATION 0xffffffff
+
+static uint64_t get_varint(unsigned char **p, unsigned char *end) {
+    uint64_t value = 0;
+    unsigned int shift = 0;
+    while (*p < end) {
+        unsigned char byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
+
+static int64_t get_zigzag(unsigned char **p, unsigned char *end) {
+    uint64_t value = get_varint(p, end);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Work out someone's generation by following the chain of infectors
+   back to someone infected at the start, then filling in the
+   generations on the way back down the chain.  The events in the log
+   can come in any order between blocks, so we can't just do this as
+   we read them. */
+static unsigned int generation_of(unsigned int who, uint32_t *infected_by, uint32_t *generations) {
+    unsigned int ancestor = who;
+    unsigned int depth = 0;
+    while (generations[ancestor] == UNKNOWN_GENERATION
+           && infected_by[ancestor] != ancestor
+           && infected_by[ancestor] != NOT_INFECTED) {
+        ancestor = infected_by[ancestor];
+        depth++;
+    }
+    unsigned int generation = (generations[ancestor] == UNKNOWN_GENERATION) ? 0 : generations[ancestor];
+    generations[ancestor] = generation;
+    unsigned int result = generation + depth;
+    for (unsigned int step = who; generations[step] == UNKNOWN_GENERATION; step = infected_by[step]) {
+        generations[step] = generation + depth--;
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage:\n  infection_tree logfile\n");
+        exit(1);
+    }
+    FILE *stream = fopen(argv[1], "rb");
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open infection log file \"%s\"\n", argv[1]);
+        exit(1);
+    }
+    char magic[sizeof(INFECTION_LOG_MAGIC)];
+    uint32_t population_size;
+    if (fread(magic, 1, sizeof(magic), stream) != sizeof(magic)
+        || memcmp(magic, INFECTION_LOG_MAGIC, sizeof(magic)) != 0
+        || fread(&population_size, sizeof(population_size), 1, stream) != 1) {
+        fprintf(stderr, "\"%s\" is not an infection log file\n", argv[1]);
+        exit(1);
+    }
+
+    uint32_t *infected_by = (uint32_t*)malloc(population_size * sizeof(uint32_t));
+    for (unsigned int i = 0; i < population_size; i++) {
+        infected_by[i] = NOT_INFECTED;
+    }
+
+    unsigned int events = 0;
+    unsigned int last_day = 0;
+    uint32_t length;
+    unsigned char *block = NULL;
+    while (fread(&length, sizeof(length), 1, stream) == 1) {
+        block = (unsigned char*)realloc(block, length);
+        if (fread(block, 1, length, stream) != length) {
+            fprintf(stderr, "Infection log file \"%s\" is truncated\n", argv[1]);
+            break;
+        }
+        unsigned int day = 0;
+        unsigned int infector = 0;
+        unsigned char *p = block;
+        unsigned char *end = block + length;
+        while (p < end) {
+            day += (unsigned int)get_varint(&p, end);
+            infector = (unsigned int)((int64_t)infector + get_zigzag(&p, end));
+            unsigned int infectee = (unsigned int)((int64_t)infector + get_zigzag(&p, end));
+            if (infector >= population_size || infectee >= population_size) {
+                fprintf(stderr, "Bad event in infection log file \"%s\"\n", argv[1]);
+                exit(1);
+            }
+            /* Only the first infection of anyone counts: */
+            if (infected_by[infectee] == NOT_INFECTED) {
+                infected_by[infectee] = infector;
+            }
+            if (day > last_day) {
+                last_day = day;
+            }
+            events++;
+        }
+    }
+    free(block);
+    fclose(stream);
+
+    uint32_t *generations = (uint32_t*)malloc(population_size * sizeof(uint32_t));
+    uint32_t *offspring = (uint32_t*)calloc(population_size, sizeof(uint32_t));
+    for (unsigned int i = 0; i < population_size; i++) {
+        generations[i] = UNKNOWN_GENERATION;
+    }
+
+    unsigned int generation_slots = 16;
+    unsigned int *generation_counts = (unsigned int*)calloc(generation_slots, sizeof(unsigned int));
+    unsigned int deepest = 0;
+    unsigned int infected = 0;
+    for (unsigned int i = 0; i < population_size; i++) {
+        if (infected_by[i] == NOT_INFECTED) {
+            continue;
+        }
+        infected++;
+        if (infected_by[i] != i) {
+            offspring[infected_by[i]]++;
+        }
+        unsigned int generation = generation_of(i, infected_by, generations);
+        while (generation >= generation_slots) {
+            generation_counts = (unsigned int*)realloc(generation_counts, 2 * generation_slots * sizeof(unsigned int));
+            memset(&generation_counts[generation_slots], 0, generation_slots * sizeof(unsigned int));
+            generation_slots *= 2;
+        }
+        generation_counts[generation]++;
+        if (generation > deepest) {
+            deepest = generation;
+        }
+    }
+
+    unsigned int most_offspring = 0;
+    for (unsigned int i = 0; i < population_size; i++) {
+        if (infected_by[i] != NOT_INFECTED && offspring[i] > most_offspring) {
+            most_offspring = offspring[i];
+        }
+    }
+    unsigned int *offspring_counts = (unsigned int*)calloc(most_offspring + 1, sizeof(unsigned int));
+    for (unsigned int i = 0; i < population_size; i++) {
+        if (infected_by[i] != NOT_INFECTED) {
+            offspring_counts[offspring[i]]++;
+        }
+    }
+
+    printf("# %u events over %u days; %u people infected\n", events, last_day + 1, infected);
+    printf("Generation,Infected\n");
+    for (unsigned int g = 0; g <= deepest; g++) {
+        printf("%u,%u\n", g, generation_counts[g]);
+    }
+    printf("\nOffspring,Infectors\n");
+    for (unsigned int k = 0; k <= most_offspring; k++) {
+        printf("%u,%u\n", k, offspring_counts[k]);
+    }
+
+    free(offspring_counts);
+    free(generation_counts);
+    free(offspring);
+    free(generations);
+    free(infected_by);
+    return 0;
+}
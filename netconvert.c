@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Convert a CSV file of contacts between people into a binary network
+   file for "epidemic --network".
+
+   Each row of the CSV file describes one contact, with the columns:
+
+   - the number of one person
+   - the number of the other person
+   - the layer of the network the contact is in (for example, 0 for
+     households, 1 for schools, 2 for workplaces), from 0 to 7
+
+   People are numbered from 0, in the same order as in the population
+   file, if one is used.  Contacts go both ways, so each row becomes a
+   pair of edges in the network.  If the first character of the file
+   is a letter, the first row is skipped as being a header.
+
+   See the comment by NETWORK_FILE_MAGIC in epidemic.c for the format
+   of the output. */
+
+#define NETWORK_FILE_MAGIC "EPINET1"
+#define MAX_CONTACT_LAYERS 8
+
+typedef struct network_file_header_t {
+    char magic[8];
+    uint32_t vertices;
+    uint32_t layers;
+    uint64_t edges;
+} network_file_header_t;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage:\n  netconvert contacts.csv network-file\n");
+        exit(1);
+    }
+    FILE *instream = fopen(argv[1], "r");
+    if (instream == NULL) {
+        fprintf(stderr, "Could not open contacts file \"%s\"\n", argv[1]);
+        exit(1);
+    }
+    FILE *outstream = fopen(argv[2], "wb");
+    if (outstream == NULL) {
+        fprintf(stderr, "Could not open network file \"%s\" for writing\n", argv[2]);
+        exit(1);
+    }
+    /* The layer numbers go after all the edges, so we hold them in a
+       scratch file until we've seen every contact. */
+    FILE *layers = tmpfile();
+
+    network_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NETWORK_FILE_MAGIC, sizeof(NETWORK_FILE_MAGIC));
+    fwrite(&header, sizeof(header), 1, outstream);
+
+    char line[256];
+    unsigned int line_number = 0;
+    uint64_t vertices = 0;
+    while (fgets(line, sizeof(line), instream) != NULL) {
+        line_number++;
+        if (line_number == 1 && isalpha(line[0])) {
+            continue;
+        }
+        long long from, to;
+        long layer;
+        if (sscanf(line, "%lld,%lld,%ld", &from, &to, &layer) != 3) {
+            continue;
+        }
+        if (from < 0 || from > UINT32_MAX - 1 || to < 0 || to > UINT32_MAX - 1
+            || layer < 0 || layer >= MAX_CONTACT_LAYERS) {
+            fprintf(stderr, "Bad contact on line %u of \"%s\"\n", line_number, argv[1]);
+            exit(1);
+        }
+        if (from == to) {
+            continue;
+        }
+        uint32_t edges[4] = {(uint32_t)from, (uint32_t)to, (uint32_t)to, (uint32_t)from};
+        uint8_t edge_layers[2] = {(uint8_t)layer, (uint8_t)layer};
+        fwrite(edges, sizeof(uint32_t), 4, outstream);
+        fwrite(edge_layers, sizeof(uint8_t), 2, layers);
+        header.edges += 2;
+        if ((uint64_t)from >= vertices) {
+            vertices = from + 1;
+        }
+        if ((uint64_t)to >= vertices) {
+            vertices = to + 1;
+        }
+        if ((uint32_t)layer >= header.layers) {
+            header.layers = layer + 1;
+        }
+    }
+    fclose(instream);
+
+    rewind(layers);
+    char buffer[65536];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), layers)) > 0) {
+        fwrite(buffer, 1, got, outstream);
+    }
+    fclose(layers);
+
+    header.vertices = (uint32_t)vertices;
+    rewind(outstream);
+    fwrite(&header, sizeof(header), 1, outstream);
+    if (fclose(outstream) != 0) {
+        fprintf(stderr, "Could not write network file \"%s\"\n", argv[2]);
+        exit(1);
+    }
+    printf("Converted %lu contacts between %u people in %u layers\n",
+           (unsigned long)(header.edges / 2), header.vertices, header.layers);
+    return 0;
+}
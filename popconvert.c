@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Convert a CSV file of individual people into a binary population
+   file for "epidemic --population-file".
+
+   Each row of the CSV file describes one person, with the columns:
+
+   - age
+   - spreader grade
+   - optionally, the x and y position of the person in the grid
+
+   If the first character of the file is a letter, the first row is
+   skipped as being a header.  If the first person has a position,
+   everyone must have one, and the grid is made just big enough to
+   hold them all.
+
+   See the comment by POPULATION_FILE_MAGIC in epidemic.c for the
+   format of the output. */
+
+#define POPULATION_FILE_MAGIC "EPIPOP1"
+#define POPULATION_POSITIONED 1
+
+/* These must match the bitfield sizes in epidemic.c's person_t: */
+#define MAX_AGE 127
+#define MAX_SPREADER_GRADE 3
+
+typedef struct population_file_header_t {
+    char magic[8];
+    uint32_t people;
+    uint32_t grid_width;
+    uint32_t grid_height;
+    uint32_t flags;
+} population_file_header_t;
+
+typedef struct population_record_t {
+    uint8_t age;
+    uint8_t spreader_grade;
+} population_record_t;
+
+/* The positions are kept as x,y pairs until the grid width is known: */
+typedef struct position_t {
+    uint32_t x;
+    uint32_t y;
+} position_t;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage:\n  popconvert people.csv population-file\n");
+        exit(1);
+    }
+    FILE *instream = fopen(argv[1], "r");
+    if (instream == NULL) {
+        fprintf(stderr, "Could not open people file \"%s\"\n", argv[1]);
+        exit(1);
+    }
+    FILE *outstream = fopen(argv[2], "wb");
+    if (outstream == NULL) {
+        fprintf(stderr, "Could not open population file \"%s\" for writing\n", argv[2]);
+        exit(1);
+    }
+    /* The positions go after all the records, so we hold them in a
+       scratch file until we've seen everyone. */
+    FILE *positions = tmpfile();
+
+    population_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POPULATION_FILE_MAGIC, sizeof(POPULATION_FILE_MAGIC));
+    fwrite(&header, sizeof(header), 1, outstream);
+
+    char line[256];
+    unsigned int line_number = 0;
+    int positioned = -1;
+    uint32_t people = 0;
+    uint32_t widest = 0;
+    uint32_t highest = 0;
+    while (fgets(line, sizeof(line), instream) != NULL) {
+        line_number++;
+        if (line_number == 1 && isalpha(line[0])) {
+            continue;
+        }
+        long age, grade, x, y;
+        int fields = sscanf(line, "%ld,%ld,%ld,%ld", &age, &grade, &x, &y);
+        if (fields < 2) {
+            continue;
+        }
+        if (positioned == -1) {
+            positioned = (fields == 4);
+        }
+        if (age < 0 || age > MAX_AGE || grade < 0 || grade > MAX_SPREADER_GRADE
+            || (positioned && (fields != 4 || x < 0 || y < 0))) {
+            fprintf(stderr, "Bad person on line %u of \"%s\"\n", line_number, argv[1]);
+            exit(1);
+        }
+        population_record_t record = {(uint8_t)age, (uint8_t)grade};
+        fwrite(&record, sizeof(record), 1, outstream);
+        if (positioned) {
+            position_t position = {(uint32_t)x, (uint32_t)y};
+            fwrite(&position, sizeof(position), 1, positions);
+            if (position.x >= widest) {
+                widest = position.x + 1;
+            }
+            if (position.y >= highest) {
+                highest = position.y + 1;
+            }
+        }
+        people++;
+    }
+    fclose(instream);
+
+    if (positioned == 1) {
+        if ((uint64_t)widest * highest > UINT32_MAX) {
+            fprintf(stderr, "Grid of %u by %u is too big\n", widest, highest);
+            exit(1);
+        }
+        /* pad to a multiple of four bytes before the cell numbers: */
+        long records_end = ftell(outstream);
+        static const char padding[4] = {0, 0, 0, 0};
+        fwrite(padding, 1, (4 - (records_end & 3)) & 3, outstream);
+        rewind(positions);
+        /* epidemic will not load a file with two people in one place,
+           so check for that here, where we can say who they are: */
+        uint8_t *claimed = (uint8_t*)calloc(((uint64_t)widest * highest + 7) / 8, 1);
+        position_t position;
+        uint32_t person = 0;
+        while (fread(&position, sizeof(position), 1, positions) == 1) {
+            uint32_t cell = position.y * widest + position.x;
+            if (claimed[cell / 8] & (1 << (cell % 8))) {
+                fprintf(stderr, "Person %u in \"%s\" is at %u,%u, where someone else already is\n",
+                        person, argv[1], position.x, position.y);
+                exit(1);
+            }
+            claimed[cell / 8] |= 1 << (cell % 8);
+            fwrite(&cell, sizeof(cell), 1, outstream);
+            person++;
+        }
+        free(claimed);
+        header.flags = POPULATION_POSITIONED;
+        header.grid_width = widest;
+        header.grid_height = highest;
+    }
+    fclose(positions);
+
+    header.people = people;
+    rewind(outstream);
+    fwrite(&header, sizeof(header), 1, outstream);
+    if (fclose(outstream) != 0) {
+        fprintf(stderr, "Could not write population file \"%s\"\n", argv[2]);
+        exit(1);
+    }
+    printf("Converted %u people\n", people);
+    return 0;
+}